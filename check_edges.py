@@ -9,7 +9,7 @@ def sig(path):
             u,v,w = line.split(b'\t')
             u=int(u); v=int(v); w=int(w)
             if u>v: u,v = v,u
-            b = u.to_bytes(4,'little') + v.to_bytes(4,'little') + bytes([w&0xFF])
+            b = u.to_bytes(8,'little') + v.to_bytes(8,'little') + w.to_bytes(2,'little')  # 64-bit ids, 16-bit weights
             h = int.from_bytes(hashlib.blake2b(b, digest_size=8).digest(), 'little')
             s = (s + h) & ((1<<64)-1)
             x ^= h
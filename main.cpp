@@ -1,7 +1,18 @@
-// build: g++ -O3 -std=gnu++17 -march=native -flto run.cpp -o run
+// build: g++ -O3 -std=gnu++17 -pthread run.cpp -o run   (no -march needed: SIMD kernels are picked at runtime, see --kernels)
 // usage:
-//   Serialize:   ./run -s -i input.tsv -o graph.bin
-//   Deserialize: ./run -d -i graph.bin -o output.tsv
+//   Serialize:   ./run -s -i input.tsv -o graph.bin [--dedup=first|max|min|sum-saturate] [--orient] [--lean] [--numa [-t threads]] [--mem-stats]
+//   Partitioned: ./run -s -i input.tsv -o outdir/ --partitions P [-t threads]
+//   Deserialize: ./run -d -i graph.bin -o output.tsv [--min-weight T] [--max-weight T] [--vertices ids.txt]
+//                [--range a:b | --orig-range a:b]
+//   Sharded:     ./run -d -i graph.bin -o outdir/ --shards P [--shard-by range|hash]
+//   Triangles:   ./run --triangles -i graph.bin [-t threads]
+//   Components:  ./run --components -i graph.bin [-o labels.tsv] [-t threads]
+//   Merge:       ./run --merge a.bin b.bin ... -o out.bin [--dedup]
+//   Deltas:      ./run --append -i batch.tsv -o base.bin; ./run --compact -i base.bin
+//   Diff/patch:  ./run --diff old.bin new.bin -o patch.bin; ./run --patch old.bin patch.bin -o new.bin
+//   Batch:       ./run --batch manifest.txt [-t threads]  (lines "s|d|append INPUT OUTPUT [OPTIONS...]")
+//   Service:     ./run --serve /path/sock [-t threads]  (framed requests: jobs, load/unload, neighbor/edge query batches, stats)
+//   Kernels:     ./run --kernels  (report; any mode takes --kernels=scalar|sse2|sse4.2|avx2|avx512 as a cap)
 //
 // Binary format (LE, version 1):
 //   [4B magic 'GRPH'][1B version=1][1B endian=1 (little)]
@@ -30,9 +41,24 @@
 //   Section C (loops): (same as v1)
 //       L: VarUInt; entries: [vertex_delta: VarUInt][weight:1B]
 //
+// Binary format (LE, version 3) -- written by the serializer:
+//   [4B magic 'GRPH'][1B version=3][1B endian=1 (little)][1B flags]
+//   [VarUInt N][VarUInt M], then Sections A, B, C exactly as in v2
+//   flags bit 1: Section B rows start with VarUInt (deg_plus << 2 | codec), codec gaps/bitmap/runs
+//       (see "Row encodings" below)
+//   flags bit 2 (--orient): each edge is stored in the row of either endpoint, so rows may hold
+//       neighbors j<i; the first offset of a row from i is zigzag-coded
+//   flags bit 3: original ids are uint64 (Section A: u64 first_original_id, then VarUInt deltas)
+//   flags bit 4: weights are u16 LE in Sections B and C and in the Section D min_w/max_w fields
+//   flags bit 0: Section D (per-block zone maps) and trailer follow Section C:
+//       records [u32 first_vertex][u64 row offset rel. to B][u64 edges][u8 min_w][u8 max_w][u32 min_nei][u32 max_nei]
+//       trailer [u64 Section C offset rel. to B][u64 Section D offset][u32 blocks]['BIDX']
+//
 // Notes:
 // - Input TSV: u \t v \t w, where u,v: uint32 and w: 0..255 (uint8); the graph is undirected.
-// - During serialization each edge is stored exactly once as (min(u,v), max(u,v)).
+//   Ids up to 2^64-1 and weights up to 65535 are accepted and select flags bits 3 and 4.
+// - During serialization each edge is stored exactly once as (min(u,v), max(u,v)), or with --orient
+//   at the endpoint that comes first in a degeneracy order.
 // - During deserialization lines may be emitted in any order; here we use increasing i and neighbor order.
 
 #include <bits/stdc++.h>
@@ -41,25 +67,283 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 // ========================= Utils: die & checks =========================
+// --batch and --serve run jobs on worker threads that set t_die_throws: a job's die() unwinds to the
+// worker as a JobError and fails only that job.
+struct JobError : runtime_error { using runtime_error::runtime_error; };
+static thread_local bool t_die_throws = false;
+
 [[noreturn]] static void die(const string &msg) {
+    if (t_die_throws) throw JobError(msg);
     fprintf(stderr, "Error: %s\n", msg.c_str());
     exit(1);
 }
 
+// Per-thread spare buffers: file writers and small-file reads take their storage from here and
+// hand it back when done, so a thread running many small jobs (--batch) allocates and faults it in
+// once. Buffers above kSpareMax are freed instead of kept.
+static constexpr size_t kSpareMax = size_t(4) << 20;
+template<class V> static V& spare_buffer(){ static thread_local V v; return v; }
+template<class V> static void take_spare(V &v, size_t cap){ v.swap(spare_buffer<V>()); v.clear(); v.reserve(cap); }
+template<class V> static void give_spare(V &v){
+    V &s = spare_buffer<V>();
+    if (v.capacity() <= kSpareMax && v.capacity() > s.capacity()){ v.clear(); s.swap(v); }
+}
+
 static bool is_little_endian() {
     uint16_t x = 1; return *reinterpret_cast<uint8_t*>(&x) == 1;
 }
 
+static bool file_exists(const string &p){ struct stat st{}; return ::stat(p.c_str(), &st)==0; }
+
+// murmur3 finalizer; spreads ids for hash partitioning
+static inline uint64_t fmix64(uint64_t x){
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33; return x;
+}
+
+static uint64_t parse_num_arg(const string &s, const char* what){
+    uint64_t x = 0;
+    auto r = std::from_chars(s.data(), s.data()+s.size(), x);
+    if (r.ec != std::errc() || r.ptr != s.data()+s.size()) die(string("invalid number for ") + what + ": " + s);
+    return x;
+}
+
+// ========================= Parallel helpers =========================
+static unsigned g_threads = 0; // -t; 0 = hardware concurrency
+
+static unsigned thread_count(){
+    unsigned t = g_threads ? g_threads : std::thread::hardware_concurrency();
+    return t ? t : 1;
+}
+
+// Calls f(begin, end) over [0, n) in chunks of `grain`, pulled dynamically by thread_count() workers.
+template<class F>
+static void parallel_for(uint64_t n, uint64_t grain, F f){
+    unsigned T = thread_count();
+    if (grain == 0) grain = 1;
+    if (T <= 1 || n <= grain){ if (n) f(uint64_t(0), n); return; }
+    atomic<uint64_t> next{0};
+    auto work = [&]{
+        for(;;){ uint64_t b = next.fetch_add(grain); if (b >= n) break; f(b, min(n, b+grain)); }
+    };
+    vector<thread> pool;
+    for (unsigned t=1;t<T;++t) pool.emplace_back(work);
+    work();
+    for (auto &th : pool) th.join();
+}
+
+// Persistent threads shared by the callers of run(n, f), which calls f(task, slot) for every task in
+// [0, n) on the pool threads and the calling thread together and returns when all are done. slot is
+// in [0, size()] and distinct among the threads working on one run(), so f can keep per-slot output.
+// Concurrent runs queue up; an idle pool thread joins the oldest one that still has tasks. The first
+// exception of a run's tasks (pool threads set t_die_throws, so die() is one) skips its remaining
+// tasks and is rethrown by run() once no thread uses the run any more; a die() becomes the caller's.
+struct ThreadPool {
+    struct Run {
+        size_t n; const std::function<void(size_t, unsigned)> &f;
+        atomic<size_t> next{0}, done{0};
+        atomic<bool> failed{false};
+        std::exception_ptr err; // guarded by m
+        unsigned helpers = 0;   // pool threads inside drain(); guarded by m
+        Run(size_t n_, const std::function<void(size_t, unsigned)> &f_) : n(n_), f(f_) {}
+    };
+    vector<thread> threads;
+    std::mutex m;
+    std::condition_variable wake, finished;
+    deque<Run*> runs;
+    bool stop = false;
+
+    explicit ThreadPool(unsigned T){ for (unsigned t=0;t<T;++t) threads.emplace_back([this, t]{ loop(t); }); }
+    ~ThreadPool(){
+        { std::lock_guard<std::mutex> lk(m); stop = true; }
+        wake.notify_all();
+        for (auto &th : threads) th.join();
+    }
+    unsigned size() const { return unsigned(threads.size()); }
+
+    void run(size_t n, const std::function<void(size_t, unsigned)> &f){
+        if (n <= 1 || threads.empty()){ for (size_t k=0;k<n;++k) f(k, size()); return; }
+        Run r(n, f);
+        { std::lock_guard<std::mutex> lk(m); runs.push_back(&r); }
+        wake.notify_all();
+        drain(r, size());
+        {
+            std::unique_lock<std::mutex> lk(m);
+            unlist(r);
+            finished.wait(lk, [&]{ return r.done.load() == n && r.helpers == 0; });
+        }
+        if (r.err){
+            try { std::rethrow_exception(r.err); }
+            catch (const JobError &e){ die(e.what()); } // exits unless the caller runs a job
+        }
+    }
+
+private:
+    void drain(Run &r, unsigned slot){
+        for (size_t k; (k = r.next.fetch_add(1)) < r.n;){
+            if (!r.failed.load(std::memory_order_relaxed)){
+                try { r.f(k, slot); }
+                catch (...){
+                    std::lock_guard<std::mutex> lk(m);
+                    if (!r.err) r.err = std::current_exception();
+                    r.failed = true;
+                }
+            }
+            r.done.fetch_add(1);
+        }
+    }
+    void unlist(Run &r){ auto it = std::find(runs.begin(), runs.end(), &r); if (it != runs.end()) runs.erase(it); }
+    void loop(unsigned slot){
+        t_die_throws = true;
+        std::unique_lock<std::mutex> lk(m);
+        for (;;){
+            wake.wait(lk, [&]{ return stop || !runs.empty(); });
+            if (runs.empty()) return;
+            Run &r = *runs.front();
+            ++r.helpers;
+            lk.unlock();
+            drain(r, slot);
+            lk.lock();
+            unlist(r); // drained: no tasks left to hand out
+            --r.helpers;
+            finished.notify_all();
+        }
+    }
+};
+
+// ========================= NUMA placement =========================
+// Nodes and their CPUs come from /sys/devices/system/node (no libnuma). Memory is placed by first
+// touch: a page lands on the node of the thread that first writes it, so threads pinned to a node
+// that initialize their own share of an array get that share allocated locally.
+struct NumaTopology {
+    vector<vector<int>> cpus; // allowed CPUs of each node that has any
+
+    static vector<int> parse_cpulist(const string &s){ // "0-3,8,10-11"
+        vector<int> out;
+        for (size_t i=0;i<s.size();){
+            char* end; long a = strtol(s.c_str()+i, &end, 10), b = a;
+            if (end == s.c_str()+i) break;
+            i = size_t(end - s.c_str());
+            if (i<s.size() && s[i]=='-'){ b = strtol(s.c_str()+i+1, &end, 10); i = size_t(end - s.c_str()); }
+            for (long c=a;c<=b;++c) out.push_back((int)c);
+            if (i<s.size() && s[i]==',') ++i; else break;
+        }
+        return out;
+    }
+    static string read_line(const string &path){
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) return "";
+        char line[4096] = {0};
+        if (!fgets(line, sizeof(line), f)) line[0] = 0;
+        fclose(f);
+        return line;
+    }
+    // Without sysfs node directories (or NUMA in the kernel) all allowed CPUs form one node.
+    static NumaTopology detect(){
+        cpu_set_t allowed; CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) for (int c=0;c<CPU_SETSIZE;++c) CPU_SET(c, &allowed);
+        NumaTopology t;
+        for (int n : parse_cpulist(read_line("/sys/devices/system/node/online"))){
+            vector<int> mine;
+            for (int c : parse_cpulist(read_line("/sys/devices/system/node/node" + to_string(n) + "/cpulist")))
+                if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)) mine.push_back(c);
+            if (!mine.empty()) t.cpus.push_back(mine);
+        }
+        if (t.cpus.empty()){
+            t.cpus.emplace_back();
+            for (int c=0;c<CPU_SETSIZE;++c) if (CPU_ISSET(c, &allowed)) t.cpus[0].push_back(c);
+        }
+        return t;
+    }
+    // Node of each of T workers, in proportion to the nodes' CPU counts; workers of one node are
+    // numbered consecutively, so contiguous work ranges map to contiguous per-node ranges.
+    vector<unsigned> assign(unsigned T) const {
+        size_t total = 0;
+        for (auto &c : cpus) total += c.size();
+        vector<unsigned> node_of(T);
+        size_t seen = 0;
+        for (unsigned n=0, t=0;n<cpus.size();++n){
+            seen += cpus[n].size();
+            const unsigned upto = n+1==cpus.size() ? T : unsigned(uint64_t(T) * seen / total);
+            for (;t<upto;++t) node_of[t] = n;
+        }
+        return node_of;
+    }
+    void pin(unsigned node) const {
+        cpu_set_t set; CPU_ZERO(&set);
+        for (int c : cpus[node]) CPU_SET(c, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set); // best effort, like MADV_HUGEPAGE
+    }
+    // Calls f(t) for every worker t on a thread of its own, pinned to node node_of[t].
+    template<class F>
+    void run(const vector<unsigned> &node_of, F f) const {
+        vector<thread> pool;
+        for (unsigned t=0;t<node_of.size();++t) pool.emplace_back([&, t]{ pin(node_of[t]); f(t); });
+        for (auto &th : pool) th.join();
+    }
+};
+
+// How many of `samples` pages spread over [b, e) sit on `node` (move_pages in query mode);
+// `seen` counts the pages the kernel reported on. Both stay 0 where the syscall is unavailable.
+static void pages_on_node(const void* b, const void* e, int node, unsigned samples, uint64_t &on, uint64_t &seen){
+    const uintptr_t lo = uintptr_t(b) & ~uintptr_t(4095), hi = uintptr_t(e);
+    if (hi <= lo) return;
+    const uint64_t pages = (hi - lo + 4095) / 4096, n = min<uint64_t>(pages, samples);
+    vector<void*> at(n); vector<int> status(n, -1);
+    for (uint64_t k=0;k<n;++k) at[k] = (void*)(lo + (pages * k / n) * 4096);
+    if (syscall(SYS_move_pages, 0, (unsigned long)n, at.data(), nullptr, status.data(), 0) != 0) return;
+    for (int st : status) if (st >= 0){ ++seen; on += st == node; }
+}
+
+// ========================= Kernel dispatch table =========================
+// Hot loops with SIMD variants are called through g_kernels, filled once at startup by
+// select_kernels() (see "CPU dispatch") for the best instruction set the host supports, so one
+// generic x86-64 binary runs the AVX2/AVX-512 paths where they exist. `*_isa` name the variants.
+struct Kernels {
+    const char* level = "scalar";
+    bool (*scan_line)(const char*&, uint32_t&, uint32_t&, uint32_t&) = nullptr; // TSV fast path; null = checked parser only
+    void (*prefix_sum)(uint32_t*, size_t, uint32_t) = nullptr;
+    uint8_t* (*encode_gaps)(uint8_t*, const uint32_t*, const uint8_t*, uint64_t) = nullptr;
+    uint64_t (*intersect)(const uint32_t*, size_t, const uint32_t*, size_t) = nullptr;
+    uint64_t (*decode_gaps)(const uint8_t*&, const uint8_t*, uint32_t*, uint8_t*, uint64_t, uint64_t, uint64_t&) = nullptr;
+    char* (*format_u32)(char*, uint32_t) = nullptr;
+    char* (*format_u64)(char*, uint64_t) = nullptr;
+    const char *scan_isa = "scalar", *prefix_isa = "scalar", *encode_isa = "scalar", *intersect_isa = "scalar";
+    const char *decode_isa = "scalar", *format_isa = "scalar";
+};
+static Kernels g_kernels;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GRAPH_X86 1
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
 // ========================= Memory-mapped file (read-only) =========================
 struct MMap {
     int fd = -1;
     size_t sz = 0;
     const char* data = nullptr;
     vector<char> fallback; // if mmap unsupported, we read into buffer
+    static constexpr size_t kSmallRead = size_t(256) << 10;
+
+    MMap() = default;
+    MMap(MMap &&o) noexcept : fd(o.fd), sz(o.sz), data(o.data), fallback(std::move(o.fallback)) { o.fd = -1; o.sz = 0; o.data = nullptr; }
+    MMap(const MMap&) = delete;
+    MMap& operator=(const MMap&) = delete;
 
     static MMap map_file(const string &path) {
         MMap m; 
@@ -73,9 +357,11 @@ struct MMap {
             m.data = nullptr;
             return m;
         }
-        void* p = mmap(nullptr, m.sz, PROT_READ, MAP_PRIVATE, m.fd, 0);
+        // small files are read into a reused buffer: cheaper than setting up and tearing down a mapping
+        void* p = m.sz <= kSmallRead ? MAP_FAILED : mmap(nullptr, m.sz, PROT_READ, MAP_PRIVATE, m.fd, 0);
         if (p == MAP_FAILED) {
             // fallback: read whole file
+            if (m.sz <= kSpareMax) take_spare(m.fallback, m.sz);
             m.fallback.resize(m.sz);
             size_t off = 0;
             while (off < m.sz) {
@@ -97,27 +383,278 @@ struct MMap {
             munmap((void*)data, sz);
         }
         if (fd >= 0) ::close(fd);
-        fd = -1; data = nullptr; sz = 0; fallback.clear();
+        fd = -1; data = nullptr; sz = 0; give_spare(fallback); fallback.clear();
     }
     ~MMap(){ close_unmap(); }
 };
 
+// ========================= Arena (huge-page backed) =========================
+// Serializer working arrays live in one anonymous mapping advised MADV_HUGEPAGE, so multi-GB passes
+// fault in 2 MB pages instead of 4 KB ones (fewer faults, fewer TLB misses). The mapping only
+// reserves address space; pages appear on first touch. It is double-ended: arrays sized once their
+// counts are known are carved from the top with keep(); the pass-1 id list, whose final size is not
+// known up front, takes the bottom with scratch() and is shrink()-ed in place to the unique ids,
+// handing the pages past them back to the kernel.
+template<class T>
+struct Span {
+    T* p = nullptr; size_t n = 0;
+    T* data() const { return p; }
+    size_t size() const { return n; }
+    T* begin() const { return p; }
+    T* end() const { return p + n; }
+    T& operator[](size_t i) const { return p[i]; }
+};
+
+struct Arena {
+    static constexpr size_t kHuge = size_t(2) << 20, kAlign = 64;
+    void* raw = nullptr;
+    uint8_t* base = nullptr;
+    size_t cap = 0, lo = 0, hi = 0; // scratch grows up from 0, keep() down from cap
+    // A released arena of up to kKeep bytes stays mapped for the thread's next Arena that fits, so
+    // back-to-back small runs (--batch) skip the mmap and the zeroing of fresh huge pages. Arenas
+    // are never assumed to be zeroed.
+    static constexpr size_t kKeep = size_t(64) << 20;
+    struct Cached { void* raw = nullptr; uint8_t* base = nullptr; size_t cap = 0; ~Cached(){ if (raw) ::munmap(raw, cap + kHuge); } };
+    static Cached& cached(){ static thread_local Cached c; return c; }
+
+    explicit Arena(size_t bytes){
+        cap = max(kHuge, (bytes + kHuge-1) & ~(kHuge-1));
+        Cached &c = cached();
+        if (c.raw && c.cap >= cap){
+            raw = c.raw; base = c.base; cap = hi = c.cap;
+            c.raw = nullptr;
+            return;
+        }
+        raw = ::mmap(nullptr, cap + kHuge, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) die("cannot reserve " + to_string(cap >> 20) + " MB of address space for the serializer arena");
+        base = (uint8_t*)((uintptr_t(raw) + kHuge-1) & ~uintptr_t(kHuge-1));
+#ifdef MADV_HUGEPAGE
+        ::madvise(base, cap, MADV_HUGEPAGE); // advisory: without THP the arena still works on 4 KB pages
+#endif
+        hi = cap;
+    }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena(){
+        Cached &c = cached();
+        if (cap > kKeep){ ::munmap(raw, cap + kHuge); return; }
+        if (c.raw) ::munmap(c.raw, c.cap + kHuge);
+        c.raw = raw; c.base = base; c.cap = cap;
+    }
+
+    // Bytes to reserve for n elements of T, alignment included
+    template<class T> static constexpr size_t bytes(uint64_t n){ return size_t(n) * sizeof(T) + kAlign; }
+    template<class T> Span<T> scratch(size_t n){
+        const size_t at = (lo + kAlign-1) & ~(kAlign-1);
+        if (at > hi || n * sizeof(T) > hi - at) die("serializer arena exhausted");
+        lo = at + n * sizeof(T);
+        return {(T*)(base + at), n};
+    }
+    template<class T> Span<T> keep(size_t n){
+        if (n * sizeof(T) + kAlign > hi - lo) die("serializer arena exhausted");
+        hi = (hi - n * sizeof(T)) & ~(kAlign-1);
+        return {(T*)(base + hi), n};
+    }
+    // Cuts the last scratch() allocation s down to n elements and releases the whole huge pages
+    // past them (partial ones stay: splitting them costs more than it returns, and a reused arena
+    // would fault them back in).
+    template<class T> void shrink(Span<T> &s, size_t n){
+        s.n = n;
+        lo = size_t((uint8_t*)s.end() - base);
+        const size_t from = (lo + kHuge-1) & ~(kHuge-1), to = min(hi, cap) & ~(kHuge-1);
+        if (to > from) ::madvise(base + from, to - from, MADV_DONTNEED);
+    }
+};
+
+// --mem-stats: page faults since construction, how much anonymous memory is in huge pages now, and
+// the peak resident set.
+struct FaultCounter {
+    rusage r0{};
+    FaultCounter(){ getrusage(RUSAGE_SELF, &r0); }
+    static uint64_t anon_huge_kb(){
+        FILE* f = fopen("/proc/self/smaps_rollup", "r");
+        if (!f) return 0;
+        char line[256]; unsigned long long kb = 0;
+        while (fgets(line, sizeof(line), f)) if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) break;
+        fclose(f);
+        return kb;
+    }
+    // `edges` (input lines) scales the peak RSS of the process into bytes per edge.
+    void report(const char* what, uint64_t edges) const {
+        rusage r{}; getrusage(RUSAGE_SELF, &r);
+        fprintf(stderr, "%s: page faults %ld minor, %ld major; %llu MB in huge pages; peak RSS %ld MB, %.1f bytes/edge\n", what,
+                r.ru_minflt - r0.ru_minflt, r.ru_majflt - r0.ru_majflt, (unsigned long long)(anon_huge_kb() >> 10),
+                r.ru_maxrss >> 10, edges ? r.ru_maxrss * 1024.0 / edges : 0.0);
+    }
+};
+
+// ========================= Concurrent id map =========================
+// Open-addressing map from original id to a provisional dense id (0, 1, ... in first-seen order),
+// shared by parser threads that cannot sort the ids up front. insert_or_get() is lock-free: a
+// thread claims an empty slot with a CAS on its key, then publishes the value it drew from the
+// counter; a thread that finds the key already claimed waits for that value. The table never fills
+// within an epoch: once the load passes 1/2, the next sync() of every participant doubles it (the
+// last one to arrive rehashes while the others wait), so a streamed input needs no size estimate.
+// renumber() turns the provisional ids into ranks in ascending original-id order, the order of
+// Section A.
+template<class Id>
+struct ConcurrentIdMap {
+    static constexpr Id kEmpty = numeric_limits<Id>::max(); // that id itself lives in the top_* fields
+    static constexpr uint32_t kPending = 0xFFFFFFFFu;
+    static constexpr unsigned kBatch = 1024; // lines (2 inserts each) a participant may parse between sync()s
+    struct Slot { atomic<Id> key; atomic<uint32_t> val; };
+
+    unique_ptr<Slot[]> slots;
+    size_t mask = 0;
+    atomic<uint64_t> count{0};
+    atomic<bool> grow{false}, top_claimed{false};
+    atomic<uint32_t> top_val{kPending};
+    mutex mu; condition_variable cv;
+    unsigned active, arrived = 0; uint64_t epoch = 0;
+
+    // `participants` threads insert and call sync() every kBatch lines, then leave() once.
+    explicit ConcurrentIdMap(unsigned participants) : active(participants) {
+        size_t cap = size_t(1) << 16;
+        while (cap < size_t(8) * kBatch * participants) cap <<= 1; // load 1/2 plus one batch per thread fits
+        slots = make_table(cap); mask = cap - 1;
+    }
+    uint64_t size() const { return count.load(); }
+
+    static unique_ptr<Slot[]> make_table(size_t cap){
+        unique_ptr<Slot[]> t(new Slot[cap]);
+        parallel_for(cap, 1<<16, [&](uint64_t b, uint64_t e){
+            for (uint64_t k=b;k<e;++k){ t[k].key.store(kEmpty, memory_order_relaxed); t[k].val.store(kPending, memory_order_relaxed); }
+        });
+        return t;
+    }
+    uint32_t draw(){
+        const uint64_t n = count.fetch_add(1, memory_order_relaxed);
+        if (n >= kPending) die("more than 2^32-1 distinct vertex ids");
+        if (n + 1 > (mask + 1) / 2) grow.store(true, memory_order_relaxed);
+        return uint32_t(n);
+    }
+    static uint32_t wait_val(const atomic<uint32_t> &v){
+        uint32_t x;
+        while ((x = v.load(memory_order_acquire)) == kPending) std::this_thread::yield();
+        return x;
+    }
+
+    uint32_t insert_or_get(Id x){
+        if (x == kEmpty){
+            bool no = false;
+            if (top_claimed.compare_exchange_strong(no, true)) top_val.store(draw(), memory_order_release);
+            return wait_val(top_val);
+        }
+        for (size_t h = fmix64(x) & mask;; h = (h + 1) & mask){
+            Slot &s = slots[h];
+            Id k = s.key.load(memory_order_acquire);
+            if (k == kEmpty && s.key.compare_exchange_strong(k, x, memory_order_acq_rel)){
+                const uint32_t v = draw();
+                s.val.store(v, memory_order_release);
+                return v;
+            }
+            if (k == x) return wait_val(s.val);
+        }
+    }
+
+    // Grow barrier: a no-op unless the table asked to grow
+    void sync(){
+        if (!grow.load(memory_order_relaxed)) return;
+        unique_lock<mutex> lk(mu);
+        const uint64_t e = epoch;
+        if (++arrived == active) rehash();
+        else cv.wait(lk, [&]{ return epoch != e; });
+    }
+    void leave(){
+        lock_guard<mutex> lk(mu);
+        --active;
+        if (active && arrived == active) rehash();
+    }
+    // Called with mu held and every active participant waiting in sync()
+    void rehash(){
+        const size_t cap = (mask + 1) * 2;
+        unique_ptr<Slot[]> t = make_table(cap);
+        parallel_for(mask + 1, 1<<14, [&](uint64_t b, uint64_t e){
+            for (uint64_t k=b;k<e;++k){
+                const Id x = slots[k].key.load(memory_order_relaxed);
+                if (x == kEmpty) continue;
+                size_t h = fmix64(x) & (cap - 1);
+                for (Id no = kEmpty; !t[h].key.compare_exchange_strong(no, x, memory_order_relaxed); no = kEmpty) h = (h + 1) & (cap - 1);
+                t[h].val.store(slots[k].val.load(memory_order_relaxed), memory_order_relaxed);
+            }
+        });
+        slots = std::move(t); mask = cap - 1;
+        grow.store(false, memory_order_relaxed);
+        arrived = 0; ++epoch;
+        cv.notify_all();
+    }
+
+    // After every participant left: uniq[r] = the r-th smallest original id, and the returned
+    // vector maps each provisional id to its rank r.
+    vector<uint32_t> renumber(Span<Id> uniq){
+        const uint64_t N = size();
+        const unsigned C = 4 * thread_count();
+        const size_t cap = mask + 1;
+        vector<pair<Id,uint32_t>> kv(N);
+        vector<uint64_t> at(C+1, 0);
+        auto chunk = [&](uint64_t c){ return std::make_pair(cap * c / C, cap * (c+1) / C); };
+        parallel_for(C, 1, [&](uint64_t cb, uint64_t ce){
+            for (uint64_t c=cb;c<ce;++c){ auto [b, e] = chunk(c); for (size_t k=b;k<e;++k) at[c+1] += slots[k].key.load(memory_order_relaxed) != kEmpty; }
+        });
+        for (unsigned c=0;c<C;++c) at[c+1] += at[c];
+        parallel_for(C, 1, [&](uint64_t cb, uint64_t ce){
+            for (uint64_t c=cb;c<ce;++c){
+                auto [b, e] = chunk(c);
+                uint64_t w = at[c];
+                for (size_t k=b;k<e;++k){ const Id x = slots[k].key.load(memory_order_relaxed); if (x != kEmpty) kv[w++] = {x, slots[k].val.load(memory_order_relaxed)}; }
+            }
+        });
+        if (top_claimed.load()) kv[at[C]] = {kEmpty, top_val.load()};
+        slots.reset();
+
+        // sort C runs, then merge them pairwise
+        vector<uint64_t> run(C+1);
+        for (unsigned c=0;c<=C;++c) run[c] = N * c / C;
+        parallel_for(C, 1, [&](uint64_t cb, uint64_t ce){ for (uint64_t c=cb;c<ce;++c) std::sort(kv.begin()+run[c], kv.begin()+run[c+1]); });
+        for (unsigned width=1;width<C;width*=2){
+            parallel_for((C + 2*width - 1) / (2*width), 1, [&](uint64_t pb, uint64_t pe){
+                for (uint64_t p=pb;p<pe;++p){
+                    const uint64_t lo = run[min<uint64_t>(C, 2*width*p)], mid = run[min<uint64_t>(C, 2*width*p + width)], hi = run[min<uint64_t>(C, 2*width*(p+1))];
+                    std::inplace_merge(kv.begin()+lo, kv.begin()+mid, kv.begin()+hi);
+                }
+            });
+        }
+        vector<uint32_t> rank(N);
+        parallel_for(N, 1<<16, [&](uint64_t b, uint64_t e){
+            for (uint64_t r=b;r<e;++r){ uniq[r] = kv[r].first; rank[kv[r].second] = uint32_t(r); }
+        });
+        return rank;
+    }
+};
+
 // ========================= Buffered binary writer =========================
 struct BinWriter {
     int fd = -1;
     vector<unsigned char> buf;
+    uint64_t flushed = 0; // bytes already handed to write()
     explicit BinWriter(const string &path, size_t cap = 1<<20) {
         fd = ::open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
         if (fd < 0) die("cannot open output: " + path);
-        buf.reserve(cap);
+        take_spare(buf, cap);
     }
-    ~BinWriter(){ flush(); if (fd>=0) ::close(fd); }
-    void flush(){ if (!buf.empty()) { ssize_t w = ::write(fd, buf.data(), buf.size()); if (w!=(ssize_t)buf.size()) die("write failed"); buf.clear(); } }
-    void put(uint8_t b){ buf.push_back(b); if (buf.size()>= (1u<<20)) flush(); }
-    void write(const void* p, size_t n){ const uint8_t* s=(const uint8_t*)p; for(size_t i=0;i<n;++i) put(s[i]); }
+    BinWriter() {} // memory sink: everything stays in buf
+    ~BinWriter(){ flush(); if (fd>=0){ ::close(fd); give_spare(buf); } }
+    void flush(){ if (fd>=0 && !buf.empty()) { ssize_t w = ::write(fd, buf.data(), buf.size()); if (w!=(ssize_t)buf.size()) die("write failed"); flushed += buf.size(); buf.clear(); } }
+    uint64_t pos() const { return flushed + buf.size(); }
+    void put(uint8_t b){ buf.push_back(b); if (fd>=0 && buf.size()>= (1u<<20)) flush(); }
+    void write(const void* p, size_t n){ const uint8_t* s=(const uint8_t*)p; buf.insert(buf.end(), s, s+n); if (fd>=0 && buf.size()>= (1u<<20)) flush(); }
+    void u16le(uint16_t x){ put(x&0xFF); put(x>>8); }
     void u32le(uint32_t x){ put((x)&0xFF); put((x>>8)&0xFF); put((x>>16)&0xFF); put((x>>24)&0xFF); }
     void u64le(uint64_t x){ for(int i=0;i<8;++i) put((x>>(8*i))&0xFF); }
     void varu(uint64_t x){ while (x>=0x80){ put(uint8_t(x)|0x80); x>>=7; } put(uint8_t(x)); }
+    // Raw append for batch encoders: room for up to n bytes, then commit() the end actually written.
+    uint8_t* grab(size_t n){ size_t at = buf.size(); buf.resize(at + n); return buf.data() + at; }
+    void commit(const uint8_t* end){ buf.resize(size_t(end - buf.data())); if (fd>=0 && buf.size() >= (1u<<20)) flush(); }
 };
 
 // ========================= Binary reader over memory =========================
@@ -127,21 +664,413 @@ struct BinReader {
     explicit BinReader(const char* data, size_t sz) : p((const uint8_t*)data), e((const uint8_t*)data+sz) {}
     bool has(size_t n) const { return size_t(e-p)>=n; }
     uint8_t get(){ if(!has(1)) die("unexpected EOF in binary file"); return *p++; }
+    uint16_t u16le(){ if(!has(2)) die("unexpected EOF (u16)"); uint16_t x = uint16_t(p[0] | (p[1]<<8)); p+=2; return x; }
     uint32_t u32le(){ if(!has(4)) die("unexpected EOF (u32)"); uint32_t x = p[0] | (uint32_t(p[1])<<8) | (uint32_t(p[2])<<16) | (uint32_t(p[3])<<24); p+=4; return x; }
     uint64_t u64le(){ if(!has(8)) die("unexpected EOF (u64)"); uint64_t x=0; for(int i=0;i<8;++i){ x |= (uint64_t)p[i]<<(8*i); } p+=8; return x; }
     uint64_t varu(){ uint64_t x=0; int s=0; while(true){ if(!has(1)) die("unexpected EOF (varint)"); uint8_t b=*p++; x |= uint64_t(b & 0x7F) << s; if(!(b&0x80)) break; s+=7; if (s>63) die("varint too long"); } return x; }
 };
 
+// ========================= Block index (zone maps) =========================
+// v3 files end with Section D: one fixed-size record per block of consecutive Section B rows,
+// followed by a trailer, so readers can seek to a block and prune it by its summary without
+// decoding any varints:
+//   record (30B): [u32 first_vertex][u64 offset of the block's first row, relative to Section B]
+//                 [u64 edges][u8 min_w][u8 max_w][u32 min_nei][u32 max_nei]
+//                 (32B with kFlagWideWeights: min_w and max_w are u16)
+//   trailer (24B): [u64 Section C offset, relative to Section B][u64 Section D file offset]
+//                  [u32 block count][4B magic 'BIDX']
+// A block covers rows first_vertex .. next block's first_vertex-1 (N-1 for the last block).
+// Empty blocks store min_w=255 (65535 when wide), max_w=0, min_nei=0xFFFFFFFF, max_nei=0.
+static constexpr uint8_t kFlagBlockIndex = 1; // v3 flags bit 0: Section D present
+static constexpr uint8_t kFlagRowCodecs = 2;  // v3 flags bit 1: Section B rows carry an encoding tag
+static constexpr uint8_t kFlagOriented = 4;   // v3 flags bit 2: edges stored at either endpoint (--orient)
+static constexpr uint8_t kFlagWideIds = 8;    // v3 flags bit 3: original ids are uint64 (Section A)
+static constexpr uint8_t kFlagWideWeights = 16; // v3 flags bit 4: weights are u16 LE (Sections B, C, D)
+
+struct BlockSummary {
+    uint32_t first = 0;
+    uint64_t offset = 0;
+    uint64_t edges = 0;
+    uint16_t wmin = 0xFFFF, wmax = 0;
+    uint32_t nmin = 0xFFFFFFFFu, nmax = 0;
+};
+
+// Cuts Section B into blocks while it is being written: a block closes once it holds
+// kBlockEdges edges or kBlockVertices rows.
+struct BlockIndexBuilder {
+    static constexpr uint64_t kBlockEdges = 4096;
+    static constexpr uint32_t kBlockVertices = 4096;
+    vector<BlockSummary> blocks;
+    uint32_t rows = 0;
+
+    static bool closes(uint32_t rows, uint64_t edges){ return rows >= kBlockVertices || edges >= kBlockEdges; }
+
+    // Call before writing the row of vertex i; `rel` is the row's offset relative to Section B.
+    inline void begin_row(uint32_t i, uint64_t rel){
+        if (blocks.empty() || closes(rows, blocks.back().edges)){
+            blocks.emplace_back(); blocks.back().first = i; blocks.back().offset = rel; rows = 0;
+        }
+        ++rows;
+    }
+    inline void add_edge(uint32_t j, uint16_t w){
+        BlockSummary &b = blocks.back();
+        ++b.edges;
+        b.wmin = min(b.wmin, w); b.wmax = max(b.wmax, w);
+        b.nmin = min(b.nmin, j); b.nmax = max(b.nmax, j);
+    }
+
+    // First rows of the blocks that rows of deg(i) edges, i=0..N-1, are cut into; runs of whole
+    // blocks can then be encoded independently (GraphWriter::rows_from).
+    template<class Deg>
+    static vector<uint32_t> starts(uint32_t N, Deg deg){
+        vector<uint32_t> out;
+        uint32_t rows = 0; uint64_t edges = 0;
+        for (uint32_t i=0;i<N;++i){
+            if (out.empty() || closes(rows, edges)){ out.push_back(i); rows = 0; edges = 0; }
+            ++rows; edges += deg(i);
+        }
+        return out;
+    }
+
+    // Appends Section D and the trailer; `loops_rel` is Section C's offset relative to Section B.
+    void write(BinWriter &bw, uint64_t loops_rel, bool wide_w) const {
+        uint64_t d_off = bw.pos();
+        for (const BlockSummary &b : blocks){
+            bw.u32le(b.first); bw.u64le(b.offset); bw.u64le(b.edges);
+            if (wide_w){ bw.u16le(b.wmin); bw.u16le(b.wmax); }
+            else { bw.put((uint8_t)min<uint16_t>(b.wmin, 255)); bw.put((uint8_t)b.wmax); }
+            bw.u32le(b.nmin); bw.u32le(b.nmax);
+        }
+        bw.u64le(loops_rel); bw.u64le(d_off); bw.u32le((uint32_t)blocks.size()); bw.write("BIDX",4);
+    }
+};
+
+// ========================= Row encodings =========================
+// With kFlagRowCodecs every Section B row starts with VarUInt (deg_plus << 2 | codec) and the
+// encoder picks the smallest of:
+//   gaps   (0): deg x [gap VarUInt][weight 1B], gap = j - prev with prev starting at i
+//   bitmap (1): [VarUInt first - i][VarUInt span = last - first][span/8+1 bytes, bit d = neighbor first+d]
+//               then deg weights
+//   runs   (2): [VarUInt R] then R x [VarUInt start - prev][VarUInt length-1], prev = i or the
+//               previous run's last neighbor; then deg weights
+// Bitmaps suit hub and clique rows, runs consecutive id ranges; both need distinct neighbors,
+// so rows with multi-edges always use gaps.
+// With kFlagOriented a row may also hold neighbors j<i, so its first offset from i (first gap,
+// bitmap `first - i`, first run start) is zigzag-coded; everything after it stays unsigned.
+enum RowCodec : uint8_t { kRowGaps = 0, kRowBitmap = 1, kRowRuns = 2 };
+
+// VarUInt byte count from the highest set bit (lzcnt/bsr), without a loop
+static inline unsigned varu_len(uint64_t x){ return 1 + unsigned(63 - __builtin_clzll(x | 1)) / 7; }
+
+// Writes VarUInt(x) followed by the weight byte w with a single unaligned 8-byte store (the caller
+// leaves 8 bytes of slack): the 7-bit groups of x are spread to bytes, continuation bits masked in
+// for all but the last group, and w lands right after it. Returns the end of the pair.
+static inline uint8_t* put_gap_weight(uint8_t* out, uint32_t x, uint8_t w){
+    const unsigned len = varu_len(x);
+    uint64_t v = (x & 0x7Fu) | (uint64_t(x & 0x3F80u) << 1) | (uint64_t(x & 0x1FC000u) << 2)
+               | (uint64_t(x & 0xFE00000u) << 3) | (uint64_t(x & 0xF0000000u) << 4);
+    v |= 0x8080808080ull & ((1ull << (8*len - 8)) - 1);
+    v |= uint64_t(w) << (8*len);
+    memcpy(out, &v, 8);
+    return out + len + 1;
+}
+
+// Encodes the gap/weight pairs of nei[1..deg-1] (the first pair has its own base) into out, which
+// must have room for 6*(deg-1) + 8 bytes; returns the end. The SIMD variants take the gaps four
+// (SSE2) or eight (AVX2) at a time by subtracting the list from itself shifted by one.
+static uint8_t* encode_gaps_scalar(uint8_t* out, const uint32_t* nei, const uint8_t* w, uint64_t deg){
+    for (uint64_t k=1; k<deg; ++k) out = put_gap_weight(out, nei[k] - nei[k-1], w[k]);
+    return out;
+}
+#if defined(__SSE2__)
+static uint8_t* encode_gaps_sse2(uint8_t* out, const uint32_t* nei, const uint8_t* w, uint64_t deg){
+    uint64_t k = 1;
+    alignas(16) uint32_t g[4];
+    for (; k+4<=deg; k+=4){
+        __m128i d = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(nei+k)), _mm_loadu_si128((const __m128i*)(nei+k-1)));
+        _mm_store_si128((__m128i*)g, d);
+        for (int q=0;q<4;++q) out = put_gap_weight(out, g[q], w[k+q]);
+    }
+    for (; k<deg; ++k) out = put_gap_weight(out, nei[k] - nei[k-1], w[k]);
+    return out;
+}
+#endif
+#if GRAPH_X86
+TARGET("avx2") static uint8_t* encode_gaps_avx2(uint8_t* out, const uint32_t* nei, const uint8_t* w, uint64_t deg){
+    uint64_t k = 1;
+    alignas(32) uint32_t g[8];
+    for (; k+8<=deg; k+=8){
+        __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(nei+k)), _mm256_loadu_si256((const __m256i*)(nei+k-1)));
+        _mm256_store_si256((__m256i*)g, d);
+        for (int q=0;q<8;++q) out = put_gap_weight(out, g[q], w[k+q]);
+    }
+    for (; k<deg; ++k) out = put_gap_weight(out, nei[k] - nei[k-1], w[k]);
+    return out;
+}
+#endif
+
+// ========================= Format policies =========================
+// The file versions and flags differ in five independent places, each captured by a policy class:
+//   mapping codec   MappingFixed32 (v1: N x u32) | MappingDelta32 (v2+: u32 first, VarUInt deltas)
+//                   | MappingDelta64 (kFlagWideIds: u64 first, VarUInt deltas)
+//   row header      PlainRows (VarUInt deg_plus, gap rows only) | TaggedRows (deg_plus << 2 | codec)
+//   first offset    UpperRows (j - i) | OrientedRows (zigzag; rows may hold j < i)
+//   weights         WeightU8 | WeightU16 (kFlagWideWeights)
+// RowFormat bundles the Section B policies. read_row_t and GraphWriter::row_as are instantiated per
+// bundle, so every layout decodes in its own loop without per-row flag tests, and a new variant adds
+// an instantiation rather than a branch in the existing ones. with_row_format() maps a file's flags
+// to its bundle once per scan; with_value_types() does the same for the original-id and weight
+// types the serializer and the TSV writer work in. New ids stay uint32 in every format.
+struct MappingFixed32 {
+    static void read(BinReader &br, vector<uint32_t> &orig, uint32_t N){ for (uint32_t i=0;i<N;++i) orig[i] = br.u32le(); }
+};
+template<class Id>
+struct MappingDelta {
+    static void read(BinReader &br, vector<Id> &orig, uint32_t N){
+        if (!N) return;
+        if constexpr (sizeof(Id) == 8) orig[0] = br.u64le(); else orig[0] = br.u32le();
+        for (uint32_t i=1;i<N;++i) orig[i] = orig[i-1] + (Id)br.varu();
+    }
+    static void write(BinWriter &bw, const Id* orig, uint32_t N){
+        if (!N) return;
+        if constexpr (sizeof(Id) == 8) bw.u64le(orig[0]); else bw.u32le(orig[0]);
+        for (uint32_t i=1;i<N;++i) bw.varu(orig[i] - orig[i-1]);
+    }
+};
+using MappingDelta32 = MappingDelta<uint32_t>;
+using MappingDelta64 = MappingDelta<uint64_t>;
+struct PlainRows  { static constexpr bool tagged = false; };
+struct TaggedRows { static constexpr bool tagged = true; };
+struct UpperRows {
+    static constexpr bool oriented = false;
+    static inline uint64_t encode(uint32_t i, uint32_t j){ return j - i; }
+    static inline uint32_t decode(uint32_t i, uint64_t d){ return i + uint32_t(d); }
+};
+struct OrientedRows {
+    static constexpr bool oriented = true;
+    static inline uint64_t encode(uint32_t i, uint32_t j){ return j >= i ? uint64_t(j - i) << 1 : (uint64_t(i - j) << 1) - 1; }
+    static inline uint32_t decode(uint32_t i, uint64_t d){ return d & 1 ? i - uint32_t((d + 1) >> 1) : i + uint32_t(d >> 1); }
+};
+struct WeightU8 {
+    using type = uint8_t; static constexpr size_t bytes = 1;
+    static inline type load(const uint8_t* p){ return *p; }
+    static inline type get(BinReader &br){ return br.get(); }
+};
+struct WeightU16 {
+    using type = uint16_t; static constexpr size_t bytes = 2;
+    static inline type load(const uint8_t* p){ return uint16_t(p[0] | (p[1] << 8)); }
+    static inline type get(BinReader &br){ return br.u16le(); }
+};
+template<class Rows, class First, class Weight = WeightU8>
+struct RowFormat { using rows = Rows; using first = First; using weight = Weight; };
+
+template<class Weight, class F>
+static inline auto with_rows(uint8_t flags, F f){
+    const bool oriented = flags & kFlagOriented;
+    if (flags & kFlagRowCodecs) return oriented ? f(RowFormat<TaggedRows, OrientedRows, Weight>{}) : f(RowFormat<TaggedRows, UpperRows, Weight>{});
+    return oriented ? f(RowFormat<PlainRows, OrientedRows, Weight>{}) : f(RowFormat<PlainRows, UpperRows, Weight>{});
+}
+template<class F>
+static inline auto with_row_format(uint8_t flags, F f){
+    return flags & kFlagWideWeights ? with_rows<WeightU16>(flags, f) : with_rows<WeightU8>(flags, f);
+}
+// Calls f(Id{}, W{}) with the original-id and weight types selected by the kFlagWide* bits.
+template<class F>
+static inline auto with_value_types(uint8_t wide, F f){
+    if (wide & kFlagWideIds) return wide & kFlagWideWeights ? f(uint64_t{}, uint16_t{}) : f(uint64_t{}, uint8_t{});
+    return wide & kFlagWideWeights ? f(uint32_t{}, uint16_t{}) : f(uint32_t{}, uint8_t{});
+}
+
+// Picks the row encoding with the fewest bytes (weights cost the same in all of them); ties go to gaps.
+template<class First>
+static RowCodec choose_row_codec(uint32_t i, const uint32_t* nei, uint64_t deg){
+    if (deg < 4) return kRowGaps;
+    const unsigned d0 = varu_len(First::encode(i, nei[0]));
+    uint64_t gaps = d0 + 1, runs_bytes = d0, runs = 1;
+    uint32_t run_prev = nei[0];
+    for (uint64_t k=1;k<deg;++k){
+        if (nei[k]==nei[k-1]) return kRowGaps; // multi-edge
+        gaps += varu_len(nei[k] - nei[k-1]) + 1;
+        if (nei[k] != nei[k-1]+1){ // a run starts at k and the previous one ends at k-1
+            runs_bytes += varu_len(nei[k-1] - run_prev) + varu_len(nei[k] - nei[k-1]); ++runs;
+            run_prev = nei[k];
+        }
+    }
+    runs_bytes += varu_len(nei[deg-1] - run_prev) + varu_len(runs) + deg;
+    const uint64_t span = nei[deg-1] - nei[0];
+    const uint64_t bitmap = d0 + varu_len(span) + span/8 + 1 + deg;
+    if (bitmap < gaps && bitmap <= runs_bytes) return kRowBitmap;
+    if (runs_bytes < gaps) return kRowRuns;
+    return kRowGaps;
+}
+
+// ========================= Graph writer (v3) =========================
+// Emits a v3 file section by section: header(), mapping(), row() for every vertex 0..N-1 in order,
+// loops_begin() and loop() for every self-loop in ascending vertex order, then finish().
+// `oriented` rows may hold neighbors below their vertex (kFlagOriented); `wide` holds the
+// kFlagWideIds/kFlagWideWeights bits, which must match the Id and W types passed to mapping(),
+// row() and loop().
+struct GraphWriter {
+    BinWriter &bw;
+    const bool oriented;
+    const uint8_t wide;
+    BlockIndexBuilder index;
+    uint64_t b_start = 0, loops_rel = 0;
+    uint32_t prev_loop = 0;
+    vector<uint8_t> bits; // bitmap row scratch
+    explicit GraphWriter(BinWriter &w, bool orient = false, uint8_t wide_bits = 0) : bw(w), oriented(orient), wide(wide_bits) {}
+
+    void header(uint32_t N, uint64_t M_total){
+        bw.write("GRPH",4); bw.put(3); bw.put(1); // version=3, little-endian
+        bw.put(kFlagBlockIndex | kFlagRowCodecs | (oriented ? kFlagOriented : 0) | wide);
+        bw.varu(N); bw.varu(M_total);
+    }
+    // mapping newId->originalId (delta + VarUInt)
+    template<class Id>
+    void mapping(const Id* orig, uint32_t N){
+        MappingDelta<Id>::write(bw, orig, N);
+        b_start = bw.pos();
+    }
+    template<class W>
+    inline void weight(W x){ bw.put(uint8_t(x)); if constexpr (sizeof(W) == 2) bw.put(uint8_t(x >> 8)); }
+    // adjacency row of vertex i (ascending neighbors, all j>i unless oriented) in whichever row
+    // encoding is smallest
+    template<class W>
+    void row(uint32_t i, const uint32_t* nei, const W* w, uint64_t deg){
+        if (oriented) row_as<OrientedRows>(i, nei, w, deg); else row_as<UpperRows>(i, nei, w, deg);
+    }
+    template<class First, class W>
+    void row_as(uint32_t i, const uint32_t* nei, const W* w, uint64_t deg){
+        index.begin_row(i, bw.pos() - b_start);
+        for (uint64_t k=0;k<deg;++k) index.add_edge(nei[k], w[k]);
+        const RowCodec c = choose_row_codec<First>(i, nei, deg);
+        bw.varu(deg << 2 | c);
+        if (c == kRowGaps){
+            if (!deg) return;
+            bw.varu(First::encode(i, nei[0])); weight(w[0]);
+            if constexpr (sizeof(W) == 1) bw.commit(g_kernels.encode_gaps(bw.grab(6*(deg-1) + 8), nei, w, deg));
+            else for (uint64_t k=1;k<deg;++k){ bw.varu(nei[k] - nei[k-1]); weight(w[k]); }
+            return;
+        }
+        if (c == kRowBitmap){
+            const uint32_t span = nei[deg-1] - nei[0];
+            bw.varu(First::encode(i, nei[0])); bw.varu(span);
+            bits.assign(span/8 + 1, 0);
+            for (uint64_t k=0;k<deg;++k){ uint32_t d = nei[k] - nei[0]; bits[d>>3] |= uint8_t(1u << (d&7)); }
+            bw.write(bits.data(), bits.size());
+        } else {
+            uint64_t runs = 1;
+            for (uint64_t k=1;k<deg;++k) runs += nei[k] != nei[k-1]+1;
+            bw.varu(runs);
+            for (uint64_t k=0;k<deg;){
+                uint64_t e = k+1;
+                while (e<deg && nei[e]==nei[e-1]+1) ++e;
+                bw.varu(k ? nei[k] - nei[k-1] : First::encode(i, nei[0])); bw.varu(e-k-1);
+                k = e;
+            }
+        }
+        if constexpr (sizeof(W) == 1) bw.write(w, deg);
+        else for (uint64_t k=0;k<deg;++k) weight(w[k]);
+    }
+    // Appends rows another GraphWriter encoded into memory sink `seg`, rebasing its block offsets;
+    // its first row must be one of BlockIndexBuilder::starts() for the whole row sequence.
+    void rows_from(const BinWriter &seg, const BlockIndexBuilder &idx){
+        const uint64_t at = bw.pos() - b_start;
+        for (BlockSummary b : idx.blocks){ b.offset += at; index.blocks.push_back(b); }
+        index.rows = idx.rows;
+        bw.write(seg.buf.data(), seg.buf.size());
+    }
+    void loops_begin(uint64_t L){
+        loops_rel = bw.pos() - b_start;
+        bw.varu(L);
+    }
+    template<class W>
+    void loop(uint32_t v, W w){
+        bw.varu(v - prev_loop);
+        weight(w);
+        prev_loop = v;
+    }
+    void finish(){
+        index.write(bw, loops_rel, wide & kFlagWideWeights);
+        bw.flush();
+    }
+};
+
 // ========================= Fast TSV scanner =========================
+// Line fast path: given the non-digit mask of the 32 bytes at q (bit k set when q[k] is not
+// '0'..'9'), the three lowest bits must be TAB, TAB, '\n' closing fields of 1..10, 1..10 and 1..3
+// digits that fit uint32/uint8. Anything else (CR, stray bytes, overflow) returns false with q
+// untouched and the checked parser takes the line, so errors are reported exactly as before.
+static inline uint32_t digits_value(const char* s, unsigned n, bool &ok){
+    uint64_t x = 0;
+    for (unsigned k=0;k<n;++k) x = x*10 + unsigned(s[k] - '0');
+    ok &= x <= 0xFFFFFFFFull;
+    return (uint32_t)x;
+}
+static inline bool scan_line_mask(const char*& q, uint32_t nd, uint32_t &a, uint32_t &b, uint32_t &w){
+    if (__builtin_popcount(nd) < 3) return false;
+    const unsigned t1 = __builtin_ctz(nd); nd &= nd-1;
+    const unsigned t2 = __builtin_ctz(nd); nd &= nd-1;
+    const unsigned t3 = __builtin_ctz(nd);
+    if (q[t1]!='\t' || q[t2]!='\t' || q[t3]!='\n') return false;
+    if (t1-1 >= 10 || t2-t1-2 >= 10 || t3-t2-2 >= 3) return false; // empty or over-long fields wrap around
+    bool ok = true;
+    a = digits_value(q, t1, ok); b = digits_value(q+t1+1, t2-t1-1, ok); w = digits_value(q+t2+1, t3-t2-1, ok);
+    if (!ok || w > 255) return false;
+    q += t3+1;
+    return true;
+}
+#if defined(__SSE2__)
+static bool scan_line_sse2(const char*& q, uint32_t &a, uint32_t &b, uint32_t &w){
+    const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+    auto nondigit = [&](const char* p){
+        __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)p), zero);
+        return ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(d, nine), nine)) & 0xFFFFu;
+    };
+    return scan_line_mask(q, nondigit(q) | nondigit(q+16) << 16, a, b, w);
+}
+#endif
+#if GRAPH_X86
+TARGET("sse4.2") static bool scan_line_sse42(const char*& q, uint32_t &a, uint32_t &b, uint32_t &w){
+    // PCMPISTRM range "09", negated: one instruction per 16 bytes gives the non-digit bit mask
+    const __m128i range = _mm_setr_epi8('0','9',0,0,0,0,0,0,0,0,0,0,0,0,0,0);
+    const int mode = _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY | _SIDD_BIT_MASK;
+    uint32_t lo = (uint32_t)_mm_cvtsi128_si32(_mm_cmpistrm(range, _mm_loadu_si128((const __m128i*)q), mode));
+    uint32_t hi = (uint32_t)_mm_cvtsi128_si32(_mm_cmpistrm(range, _mm_loadu_si128((const __m128i*)(q+16)), mode));
+    return scan_line_mask(q, (lo & 0xFFFFu) | hi << 16, a, b, w);
+}
+TARGET("avx2") static bool scan_line_avx2(const char*& q, uint32_t &a, uint32_t &b, uint32_t &w){
+    const __m256i nine = _mm256_set1_epi8(9);
+    __m256i d = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)q), _mm256_set1_epi8('0'));
+    return scan_line_mask(q, ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(d, nine), nine)), a, b, w);
+}
+TARGET("avx512bw,avx512vl") static bool scan_line_avx512(const char*& q, uint32_t &a, uint32_t &b, uint32_t &w){
+    // compare straight into a mask register: no max/cmpeq/movemask/not chain
+    const __m256i d = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)q), _mm256_set1_epi8('0'));
+    return scan_line_mask(q, (uint32_t)_mm256_cmpgt_epu8_mask(d, _mm256_set1_epi8(9)), a, b, w);
+}
+#endif
+
 struct TSVScanner {
     const char* p; const char* e;
+    bool drop_behind = false; // --lean: p..e is a file mapping whose scanned pages are unmapped as we go
+    static constexpr size_t kDropChunk = size_t(32) << 20;
     explicit TSVScanner(const char* data, size_t sz): p(data), e(data+sz) {}
 
+    // Returns the whole pages of [from, to) to the page cache (MADV_DONTNEED on a read-only file
+    // mapping only drops our mapping of them) so a pass over a large input keeps ~kDropChunk of it
+    // resident; returns the new low end.
+    static const char* drop_pages(const char* from, const char* to){
+        const uintptr_t a = (uintptr_t(from) + 4095) & ~uintptr_t(4095), b = uintptr_t(to) & ~uintptr_t(4095);
+        if (b > a) ::madvise((void*)a, b - a, MADV_DONTNEED);
+        return b > a ? (const char*)b : from;
+    }
+
     static inline void skip_newline(const char*& q, const char* e){ if(q<e && *q=='\r'){ ++q; } if(q<e && *q=='\n'){ ++q; } }
 
-    static inline bool parse_u32_until(const char*& q, const char* e, char delim, uint32_t &out){
+    static inline bool parse_uint_until(const char*& q, const char* e, char delim, uint64_t &out){
         uint64_t x=0; bool any=false;
-        while(q<e){ unsigned char c=*q++; if (c>='0' && c<='9'){ any=true; x = x*10 + (c - '0'); if (x>0xFFFFFFFFull) return false; }
+        while(q<e){ unsigned char c=*q++; if (c>='0' && c<='9'){ any=true; if (__builtin_mul_overflow(x, 10u, &x) || __builtin_add_overflow(x, unsigned(c - '0'), &x)) return false; }
             else if (c== (unsigned char)delim){ break; }
             else if (delim=='\n' && (c=='\n' || c=='\r')){ // end of line
                 // if '\r', consume possible '\n' in caller
@@ -152,285 +1081,2826 @@ struct TSVScanner {
             }
         }
         if(!any) return false;
-        out = (uint32_t)x;
+        out = x;
         return true;
     }
 
-    template<class F>
-    void for_each_triplet(F f){
+    // Calls f(a, b, w) per line as Id/W values. Ids may take up to 64 bits and weights up to 16;
+    // a line whose values do not fit Id/W stops the scan, and the return value holds the
+    // kFlagWideIds/kFlagWideWeights bits it needs (0 after a complete scan).
+    template<class Id = uint32_t, class W = uint8_t, class F>
+    uint8_t for_each_triplet(F f){
         const char* q = p;
+        const auto scan_line = g_kernels.scan_line;
+        const char* dropped = p;
+        const char* drop_at = drop_behind && size_t(e-p) > kDropChunk ? p + kDropChunk : e;
         while(q<e){
+            if (q >= drop_at){ dropped = drop_pages(dropped, q); drop_at = size_t(e-q) > kDropChunk ? q + kDropChunk : e; }
+            uint32_t a32,b32,w32;
+            if (scan_line && e-q >= 32 && scan_line(q, a32, b32, w32)){ f(Id(a32),Id(b32),W(w32)); continue; }
             // skip stray newlines
             if (*q=='\n' || *q=='\r'){ skip_newline(q,e); continue; }
-            uint32_t a,b,w;
-            bool ok1 = parse_u32_until(q,e,'\t', a);
-            if(!ok1) die("parse error: expected first uint32 before TAB");
-            bool ok2 = parse_u32_until(q,e,'\t', b);
-            if(!ok2) die("parse error: expected second uint32 before TAB");
-            bool ok3 = parse_u32_until(q,e,'\n', w);
-            if(!ok3 || w>255) die("parse error: expected weight 0..255 then newline");
+            uint64_t a,b,w;
+            bool ok1 = parse_uint_until(q,e,'\t', a);
+            if(!ok1) die("parse error: expected first id (uint64) before TAB");
+            bool ok2 = parse_uint_until(q,e,'\t', b);
+            if(!ok2) die("parse error: expected second id (uint64) before TAB");
+            bool ok3 = parse_uint_until(q,e,'\n', w);
+            if(!ok3 || w>0xFFFF) die("parse error: expected weight 0..65535 then newline");
+            if (max(a, b) > numeric_limits<Id>::max() || w > numeric_limits<W>::max())
+                return (max(a, b) > 0xFFFFFFFFull ? kFlagWideIds : 0) | (w > 255 ? kFlagWideWeights : 0);
             // consume line ending if \r optional and \n
             if (q<e && q[-1]=='\r'){ // last consumed was '\r'
                 if (q<e && *q=='\n') ++q; // eat '\n'
             }
-            f(a,b,(uint8_t)w);
+            f(Id(a),Id(b),W(w));
         }
+        if (drop_behind) drop_pages(dropped, e + 4095);
+        return 0;
     }
 };
 
 // ========================= Text writer (buffered) =========================
+// Decimal formatting kernels: write x at out and return the end; the caller leaves 32 bytes of room,
+// as the SIMD variant stores whole 8- and 16-digit groups. Numbers below 1000 (every 8-bit weight)
+// are one 4-byte store from kSmallDecimals, without a branch on their length. Above that the scalar
+// variant emits two digits per step from a pair table after sizing the number from its bit length;
+// SSE2 turns 8 digits at once into 16-bit lanes by multiply-high with reciprocal powers of ten (the
+// low and high 8 digits of a 64-bit id side by side) and drops leading zeros with one compare mask.
+struct SmallDecimals {
+    uint32_t v[1000]; // the digits of i in the low bytes, their count in the top byte
+    SmallDecimals(){
+        for (unsigned i=0;i<1000;++i){
+            char t[4] = {0,0,0,0};
+            const unsigned n = unsigned(std::to_chars(t, t+3, i).ptr - t);
+            v[i] = uint32_t((uint8_t)t[0]) | uint32_t((uint8_t)t[1]) << 8 | uint32_t((uint8_t)t[2]) << 16 | n << 24;
+        }
+    }
+};
+static const SmallDecimals kSmallDecimals;
+static inline char* format_small(char* out, uint32_t x){ // x < 1000
+    const uint32_t v = kSmallDecimals.v[x];
+    memcpy(out, &v, 4);
+    return out + (v >> 24);
+}
+static const char kDigitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+static const uint64_t kPow10[20] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+    10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull,
+    10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull};
+// x | 1 has the digit count of x and a bit length >= 1; 1233/4096 ~ log10(2)
+static inline unsigned dec_digits(uint64_t x){
+    x |= 1;
+    const unsigned t = unsigned(64 - __builtin_clzll(x)) * 1233 >> 12;
+    return t + 1 - (x < kPow10[t]);
+}
+template<class T>
+static inline char* format_dec(char* out, T x){
+    if (x < 1000) return format_small(out, uint32_t(x));
+    char* const end = out + dec_digits(x);
+    char* p = end;
+    while (x >= 100){ const T q = x / 100; p -= 2; memcpy(p, kDigitPairs + 2*(x - q*100), 2); x = q; }
+    if (x >= 10){ p -= 2; memcpy(p, kDigitPairs + 2*x, 2); } else *--p = char('0' + x);
+    return end;
+}
+static char* format_u32_scalar(char* out, uint32_t x){ return format_dec(out, x); }
+static char* format_u64_scalar(char* out, uint64_t x){ return format_dec(out, x); }
+#if defined(__SSE2__)
+// The 8 decimal digits of x < 10^8 as 16-bit lanes, most significant first
+static inline __m128i eight_digits_sse2(uint32_t x){
+    const __m128i abcdefgh = _mm_cvtsi32_si128((int)x);
+    const __m128i abcd = _mm_srli_epi64(_mm_mul_epu32(abcdefgh, _mm_set1_epi32((int)0xD1B71759)), 45); // x / 10^4
+    const __m128i efgh = _mm_sub_epi32(abcdefgh, _mm_mul_epu32(abcd, _mm_set1_epi32(10000)));
+    const __m128i v1 = _mm_slli_epi64(_mm_unpacklo_epi16(abcd, efgh), 2);
+    const __m128i v2a = _mm_unpacklo_epi16(v1, v1);
+    const __m128i v2 = _mm_unpacklo_epi32(v2a, v2a);                        // 4*abcd x4, 4*efgh x4
+    const __m128i v3 = _mm_mulhi_epu16(v2, _mm_setr_epi16(8389, 5243, 13108, -32768, 8389, 5243, 13108, -32768));
+    const __m128i v4 = _mm_mulhi_epu16(v3, _mm_setr_epi16(1<<7, 1<<11, 1<<13, -32768, 1<<7, 1<<11, 1<<13, -32768));
+    return _mm_sub_epi16(v4, _mm_slli_epi64(_mm_mullo_epi16(v4, _mm_set1_epi16(10)), 16)); // a, ab, abc, abcd -> a, b, c, d
+}
+static inline __m128i ascii_digits_sse2(uint32_t hi, uint32_t lo){
+    return _mm_add_epi8(_mm_packus_epi16(eight_digits_sse2(hi), eight_digits_sse2(lo)), _mm_set1_epi8('0'));
+}
+static inline unsigned leading_zero_digits(__m128i d){
+    return unsigned(__builtin_ctz(~unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_set1_epi8('0'))))));
+}
+static char* format_u32_sse2(char* out, uint32_t x){
+    if (x < 10000) return format_dec(out, x);
+    if (x >= 100000000){
+        const uint32_t hi = x / 100000000;
+        out = format_small(out, hi);
+        _mm_storel_epi64((__m128i*)out, ascii_digits_sse2(x - hi*100000000, 0));
+        return out + 8;
+    }
+    const __m128i d = ascii_digits_sse2(x, 0);
+    const unsigned lz = leading_zero_digits(d); // < 4 as x >= 10^4
+    const uint64_t v = uint64_t(_mm_cvtsi128_si64(d)) >> (8*lz);
+    memcpy(out, &v, 8);
+    return out + 8 - lz;
+}
+static char* format_u64_sse2(char* out, uint64_t x){
+    if (x <= 0xFFFFFFFFull) return format_u32_sse2(out, uint32_t(x));
+    if (x >= kPow10[16]){
+        const uint64_t hi = x / kPow10[16];
+        out = format_dec(out, uint32_t(hi));
+        x -= hi * kPow10[16];
+        _mm_storeu_si128((__m128i*)out, ascii_digits_sse2(uint32_t(x / 100000000), uint32_t(x % 100000000)));
+        return out + 16;
+    }
+    const __m128i d = ascii_digits_sse2(uint32_t(x / 100000000), uint32_t(x % 100000000));
+    const unsigned lz = leading_zero_digits(d); // <= 6 as x >= 2^32
+    uint64_t a = uint64_t(_mm_cvtsi128_si64(d)), b = uint64_t(_mm_cvtsi128_si64(_mm_unpackhi_epi64(d, d)));
+    if (lz){ a = a >> (8*lz) | b << (64 - 8*lz); b >>= 8*lz; }
+    memcpy(out, &a, 8); memcpy(out + 8, &b, 8);
+    return out + 16 - lz;
+}
+#endif
+
+// Pending output is buf[0, n), written out once it reaches kFlush; kSlack past it takes the stores
+// of one formatted number.
 struct TextWriter {
+    static constexpr size_t kFlush = size_t(1) << 20, kSlack = 32;
     int fd = -1;
     vector<char> buf;
-    explicit TextWriter(const string &path, size_t cap=1<<20){
+    size_t n = 0;
+    explicit TextWriter(const string &path){
         fd = ::open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
         if (fd<0) die("cannot open output: "+path);
-        buf.reserve(cap);
-    }
-    ~TextWriter(){ flush(); if(fd>=0) ::close(fd); }
-    void flush(){ if(!buf.empty()){ ssize_t w = ::write(fd, buf.data(), buf.size()); if (w!=(ssize_t)buf.size()) die("write text failed"); buf.clear(); } }
-    inline void put(char c){ buf.push_back(c); if (buf.size()>= (1u<<20)) flush(); }
-    inline void puts(const char* s, size_t n){ for(size_t i=0;i<n;++i) put(s[i]); }
-    inline void putu(uint32_t x){ char tmp[16]; auto r = std::to_chars(tmp, tmp+16, x); if (r.ec != std::errc()) die("to_chars failed (u32)"); puts(tmp, r.ptr - tmp); }
-    inline void putu8(uint8_t x){ char tmp[8]; auto r = std::to_chars(tmp, tmp+8, (unsigned)x); if (r.ec != std::errc()) die("to_chars failed (u8)"); puts(tmp, r.ptr - tmp); }
+        take_spare(buf, kFlush + kSlack); buf.resize(kFlush + kSlack);
+    }
+    ~TextWriter(){ flush(); if(fd>=0) ::close(fd); give_spare(buf); }
+    void flush(){ if(n){ ssize_t w = ::write(fd, buf.data(), n); if (w!=(ssize_t)n) die("write text failed"); n = 0; } }
+    inline void put(char c){ buf[n++] = c; if (n >= kFlush) flush(); }
+    inline void puts(const char* s, size_t len){
+        while (len){ const size_t k = min(len, kFlush - n); memcpy(buf.data() + n, s, k); n += k; s += k; len -= k; if (n >= kFlush) flush(); }
+    }
+    inline void putu(uint32_t x){ n = size_t(g_kernels.format_u32(buf.data() + n, x) - buf.data()); if (n >= kFlush) flush(); }
+    inline void putu(uint64_t x){ n = size_t(g_kernels.format_u64(buf.data() + n, x) - buf.data()); if (n >= kFlush) flush(); }
+    inline void putw(uint8_t x){ putu(uint32_t(x)); }
+    inline void putw(uint16_t x){ putu(uint32_t(x)); }
     inline void newline(){ put('\n'); }
 };
 
 // ========================= Core: serialize =========================
+// Multi-edge aggregation applied after the per-vertex neighbor sort (--dedup=...): duplicates of a
+// (u, v) pair, including repeated self-loops, collapse into one edge whose weight is the first one
+// in input order, the max, the min, or the sum clamped to the weight range (255, or 65535 with
+// 16-bit weights).
+enum class Dedup { None, First, Max, Min, SumSaturate };
+
+// Folds a duplicate's weight x into the kept weight w under the --dedup policy.
+template<class W>
+static void merge_weight(W &w, W x, Dedup mode){
+    switch (mode){
+        case Dedup::Max: w = max(w, x); break;
+        case Dedup::Min: w = min(w, x); break;
+        case Dedup::SumSaturate: w = (W)min<unsigned>(numeric_limits<W>::max(), unsigned(w) + x); break;
+        default: break; // First
+    }
+}
+
+// Collapses runs of equal ids in an id-sorted (input-order-stable) list; returns the new length.
+template<class W>
+static size_t collapse_duplicates(pair<uint32_t,W>* a, size_t len, Dedup mode){
+    size_t out = 0;
+    for (size_t k=0;k<len;++k){
+        if (out && a[out-1].first == a[k].first) merge_weight(a[out-1].second, a[k].second, mode);
+        else a[out++] = a[k];
+    }
+    return out;
+}
+
 struct Serializer {
     string in_path, out_path;
+    unsigned partitions = 0; // --partitions P: out_path is a directory of P standalone .bin files
+    Dedup dedup = Dedup::None;
+    bool orient = false;     // --orient: store edges at their degeneracy-order source (kFlagOriented)
+    bool narrow = false;     // --append: deltas must keep 32-bit ids and 8-bit weights to merge with their base
+    bool lean = false;       // --lean: trade pass-1 CPU and input re-reads for a smaller resident set
+    bool numa = false;       // --numa: single-pass ingest, build and row encoding on threads pinned per NUMA node
+    bool mem_stats = false;  // --mem-stats: report page faults and peak RSS to stderr
+    FaultCounter faults;
+
+    // Serializes with 32-bit original ids and 8-bit weights unless the input holds larger values:
+    // then pass 1 stops at the first such line and the run restarts with uint64 ids and/or uint16
+    // weights (kFlagWideIds/kFlagWideWeights), so narrow inputs never pay for the wide types.
     void run(){
         if (!is_little_endian()) die("host is not little-endian");
+        faults = FaultCounter();
         MMap mm = MMap::map_file(in_path);
-        const char* data = mm.data; size_t sz = mm.sz;
-        TSVScanner scan(data, sz);
-
-        // Pass 1: collect all ids
-        vector<uint32_t> all_ids; all_ids.reserve(sz / 10); // heuristic
-        size_t line_cnt = 0;
-        scan.for_each_triplet([&](uint32_t a, uint32_t b, uint8_t w){ (void)w; all_ids.push_back(a); all_ids.push_back(b); ++line_cnt; });
-        
-        if (line_cnt==0){ // empty graph
-            BinWriter bw(out_path);
-            // header (v2)
-            bw.write("GRPH",4); bw.put(2); bw.put(1); // version=2, endian
-            bw.varu(0); bw.varu(0); // N, M
-            // no mapping, no adj, no loops
-            return;
+        uint8_t wide = 0;
+        while (uint8_t more = with_value_types(wide, [&](auto id, auto w){ return run_as<decltype(id), decltype(w)>(mm); })){
+            if (narrow) die("--append batches need ids below 2^32 and weights 0..255, like the base they are merged into");
+            wide |= more;
+        }
+    }
+
+    TSVScanner scanner(const MMap &mm) const {
+        TSVScanner scan(mm.data, mm.sz);
+        scan.drop_behind = lean && mm.fallback.empty();
+        return scan;
+    }
+
+    // --numa: worker layout of a run, and what it measured.
+    struct NumaBuild {
+        NumaTopology topo;
+        vector<unsigned> node_of; // node of worker t
+        vector<uint32_t> cut;     // worker t owns rows [cut[t], cut[t+1])
+        uint64_t edges = 0, crossed = 0, pages_local = 0, pages_seen = 0;
+        static NumaBuild layout(){
+            NumaBuild nb;
+            nb.topo = NumaTopology::detect();
+            nb.node_of = nb.topo.assign(thread_count());
+            return nb;
+        }
+        void report() const {
+            fprintf(stderr, "numa: %zu node(s), %zu threads; %.1f%% of edges handed across nodes; ",
+                    topo.cpus.size(), node_of.size(), edges ? 100.0 * crossed / edges : 0.0);
+            if (pages_seen) fprintf(stderr, "%.1f%% of sampled row pages on their owner's node\n", 100.0 * pages_local / pages_seen);
+            else fprintf(stderr, "page placement not available\n");
+        }
+    };
+    template<class W> struct ScatterEdge { uint32_t u, v; W w; };
+    template<class E> using EdgeRuns = vector<vector<E>>; // chunks of kRunChunk edges, freed as consumed
+    static constexpr size_t kRunChunk = size_t(1) << 16;
+    template<class E> static void push_run(EdgeRuns<E> &r, const E &e){
+        if (r.empty() || r.back().size() == kRunChunk){ r.emplace_back(); r.back().reserve(kRunChunk); }
+        r.back().push_back(e);
+    }
+
+    // --numa: the single pass over the input, as handed to build(): each worker's edges in input
+    // order with provisional ids, and the rank (new id) of every provisional id.
+    template<class W>
+    struct NumaIngest {
+        NumaBuild nb;
+        vector<EdgeRuns<ScatterEdge<W>>> parsed;
+        vector<uint32_t> rank;
+    };
+
+    // Pass 1 collects the ids into the bottom of the arena, sorts them and keeps the unique prefix in
+    // place as uniq. With --lean the list is compacted (sort + unique) whenever the unsorted tail
+    // grows past the unique head, so it peaks near 2N entries instead of 2 per input line.
+    template<class Id, class W>
+    uint8_t run_as(const MMap &mm){
+        TSVScanner scan = scanner(mm);
+
+        // Working arrays come from one arena sized from the input: a line takes at least 6 bytes
+        // ("u\tv\tw\n", the last '\n' optional), which bounds the line count L, and N <= 2L.
+        // scratch(): all_ids -> uniq; keep(): off, upper_nei, upper_w, loop_v, loop_w.
+        const uint64_t L = (uint64_t(mm.sz) + 1) / 6 + 1;
+        Arena arena(Arena::bytes<Id>(2*L) + Arena::bytes<uint64_t>(2*L+2) + Arena::bytes<uint32_t>(L) + Arena::bytes<W>(L)
+                    + Arena::bytes<uint32_t>(L) + Arena::bytes<W>(L));
+        if (numa) return run_numa<Id, W>(mm, arena);
+
+        // Pass 1: collect all ids; uniq ids -> newId mapping (sorted ascending by original id)
+        Span<Id> ids = arena.scratch<Id>(2*L);
+        size_t n = 0, u = 0; // ids[0, u) sorted and unique (--lean), [u, n) pending
+        uint64_t lines = 0;
+        auto compact = [&]{ sort(ids.begin(), ids.begin()+n); n = u = size_t(unique(ids.begin(), ids.begin()+n) - ids.begin()); };
+        const size_t kMinPending = size_t(1) << 20;
+        uint8_t more = lean
+            ? scan.for_each_triplet<Id, W>([&](Id a, Id b, W){ ids[n++] = a; ids[n++] = b; ++lines; if (n - u >= max(u, kMinPending)) compact(); })
+            : scan.for_each_triplet<Id, W>([&](Id a, Id b, W){ ids[n++] = a; ids[n++] = b; ++lines; });
+        if (more) return more;
+
+        if (lines==0){ write_empty<Id, W>(); return 0; }
+        compact();
+        if (u > 0xFFFFFFFFull) die("more than 2^32-1 distinct vertex ids");
+        arena.shrink(ids, u);
+        // Offsets count upper edges plus loops, at most one per line
+        if (lines <= 0xFFFFFFFFull) build<Id, W, uint32_t>(mm, arena, ids, lines);
+        else build<Id, W, uint64_t>(mm, arena, ids, lines);
+        return 0;
+    }
+
+    template<class Id, class W>
+    void write_empty(){
+        uint64_t zero[2] = {0, 0};
+        if (partitions){ write_partitions<Id, W, uint64_t>({}, {zero, 1}, {}, {}, {}, {}); return; }
+        BinWriter bw(out_path);
+        GraphWriter gw(bw);
+        gw.header(0, 0); gw.mapping((const uint32_t*)nullptr, 0); // no mapping, no adj
+        gw.loops_begin(0); gw.finish();
+    }
+
+    // --numa replaces pass 1 with a single parallel pass: worker t parses the t-th slice of the input
+    // once, on a thread pinned to its node, assigning provisional ids through a shared
+    // ConcurrentIdMap and keeping its edges in runs. The map is then renumbered into ascending
+    // original-id order (Section A as before) and build() continues from the runs.
+    template<class Id, class W>
+    uint8_t run_numa(const MMap &mm, Arena &arena){
+        using Edge = ScatterEdge<W>;
+        NumaIngest<W> in;
+        in.nb = NumaBuild::layout();
+        const unsigned T = unsigned(in.nb.node_of.size());
+
+        // input slices end after a newline
+        vector<const char*> slice(T+1, mm.data + mm.sz);
+        slice[0] = mm.data;
+        for (unsigned t=1;t<T;++t){
+            const char* x = max(slice[t-1], mm.data + size_t(uint64_t(mm.sz) * t / T));
+            const char* nl = x > mm.data ? (const char*)memchr(x-1, '\n', size_t(mm.data + mm.sz - (x-1))) : x-1;
+            slice[t] = nl ? nl+1 : mm.data + mm.sz;
         }
 
-        // uniq ids -> newId mapping (sorted ascending by original id)
-        vector<uint32_t> uniq = all_ids; 
-        sort(uniq.begin(), uniq.end()); uniq.erase(unique(uniq.begin(), uniq.end()), uniq.end());
-        all_ids.clear(); all_ids.shrink_to_fit();
+        ConcurrentIdMap<Id> ids(T);
+        in.parsed.resize(T);
+        vector<uint8_t> more(T, 0);
+        in.nb.topo.run(in.nb.node_of, [&](unsigned t){
+            TSVScanner scan(slice[t], size_t(slice[t+1] - slice[t]));
+            scan.drop_behind = lean && mm.fallback.empty();
+            unsigned batch = 0;
+            more[t] = scan.for_each_triplet<Id, W>([&](Id a, Id b, W w){
+                push_run(in.parsed[t], Edge{ids.insert_or_get(a), ids.insert_or_get(b), w});
+                if (++batch == ConcurrentIdMap<Id>::kBatch){ batch = 0; ids.sync(); }
+            });
+            ids.leave();
+        });
+        uint8_t wider = 0;
+        for (uint8_t m : more) wider |= m;
+        if (wider) return wider;
+
+        uint64_t lines = 0;
+        for (auto &runs : in.parsed) for (auto &chunk : runs) lines += chunk.size();
+        if (lines==0){ write_empty<Id, W>(); return 0; }
+        Span<Id> uniq = arena.scratch<Id>(ids.size());
+        in.rank = ids.renumber(uniq);
+        if (lines <= 0xFFFFFFFFull) build<Id, W, uint32_t>(mm, arena, uniq, lines, &in);
+        else build<Id, W, uint64_t>(mm, arena, uniq, lines, &in);
+        return 0;
+    }
+
+    // Passes 2 and 3 build the upper CSR in place: pass 2 counts row sizes into off[u+2], the prefix
+    // sum turns off[i+1] into the start of row i, and pass 3 fills through off[u+1]++ so that it ends
+    // as the end of row i, with no separate degree or cursor arrays. Self-loops are filled into their
+    // row as neighbor i and are moved out to loop_v/loop_w when rows are sorted.
+    // Off is uint32_t when the input has fewer than 2^32 lines. With --numa the passes run on the
+    // parsed runs of `in` instead (build_numa).
+    template<class Id, class W, class Off>
+    void build(const MMap &mm, Arena &arena, Span<Id> uniq, uint64_t lines, NumaIngest<W>* in = nullptr){
+        constexpr uint8_t wide = (sizeof(Id) == 8 ? kFlagWideIds : 0) | (sizeof(W) == 2 ? kFlagWideWeights : 0);
         const uint32_t N = (uint32_t)uniq.size();
 
-        auto idx_of = [&](uint32_t orig)->uint32_t{
+        auto idx_of = [&](Id orig)->uint32_t{
             auto it = std::lower_bound(uniq.begin(), uniq.end(), orig);
             if (it==uniq.end() || *it!=orig) die("id not found in uniq (internal)");
             return (uint32_t)(it - uniq.begin());
         };
 
-        // Pass 2: count deg_plus and loops
-        vector<uint32_t> deg_plus(N, 0);
-        uint64_t M_noLoops = 0;
-        uint64_t loops_count = 0;
-        TSVScanner scan2(data, sz);
-        scan2.for_each_triplet([&](uint32_t a, uint32_t b, uint8_t w){
-            (void)w;
-            uint32_t ia = idx_of(a);
-            uint32_t ib = idx_of(b);
-            if (ia==ib){ ++loops_count; }
-            else { uint32_t u = min(ia,ib); uint32_t v = max(ia,ib); (void)v; ++deg_plus[u]; ++M_noLoops; }
-        });
+        Span<Off> off = arena.keep<Off>(N+2);
+        Span<uint32_t> upper_nei, loop_v;
+        Span<W> upper_w, loop_w;
+        uint64_t collapsed = 0;
+        if (in) build_numa(*in, arena, off, upper_nei, upper_w, loop_v, loop_w, collapsed);
+        else {
+            // Pass 2: count row sizes (loops included) and loops
+            std::fill(off.begin(), off.end(), Off(0));
+            uint64_t loops_count = 0;
+            scanner(mm).for_each_triplet<Id, W>([&](Id a, Id b, W){
+                uint32_t ia = idx_of(a);
+                uint32_t ib = idx_of(b);
+                loops_count += ia==ib;
+                ++off[min(ia,ib)+2];
+            });
+            for (uint32_t i=2;i<=N+1;++i) off[i] += off[i-1];
+            upper_nei = arena.keep<uint32_t>(off[N+1]);
+            upper_w   = arena.keep<W>(off[N+1]);
 
-        // Prefix sums for upper adjacency storage
-        vector<uint64_t> off(N+1, 0);
-        for (uint32_t i=0;i<N;++i) off[i+1] = off[i] + deg_plus[i];
-        vector<uint32_t> upper_nei; upper_nei.resize(off[N]);
-        vector<uint8_t>  upper_w;  upper_w.resize(off[N]);
-        vector<uint64_t> cur = off;
-
-        // Pass 3: fill adjacency and collect loops
-        vector<pair<uint32_t,uint8_t>> loops; loops.reserve(loops_count);
-        TSVScanner scan3(data, sz);
-        scan3.for_each_triplet([&](uint32_t a, uint32_t b, uint8_t w){
-            uint32_t ia = idx_of(a);
-            uint32_t ib = idx_of(b);
-            if (ia==ib){ loops.emplace_back(ia, w); }
-            else {
+            // Pass 3: fill adjacency (loops as neighbor i of row i)
+            scanner(mm).for_each_triplet<Id, W>([&](Id a, Id b, W w){
+                uint32_t ia = idx_of(a);
+                uint32_t ib = idx_of(b);
                 uint32_t u = min(ia,ib); uint32_t v = max(ia,ib);
-                uint64_t pos = cur[u]++;
+                Off pos = off[u+1]++;
                 upper_nei[pos] = v;
                 upper_w[pos] = w;
-            }
-        });
+            });
 
-        // Sort neighbor lists per vertex by neighbor (ascending), permuting weights accordingly
-        vector<pair<uint32_t,uint8_t>> tmp; tmp.reserve(32);
-        for (uint32_t i=0;i<N;++i){
-            uint64_t b = off[i], e = off[i+1];
+            loop_v = arena.keep<uint32_t>(loops_count);
+            loop_w = arena.keep<W>(loops_count);
+            uint64_t nl = 0;
+            off[N] = Off(sort_rows(0, N, 0, off, upper_nei, upper_w, loop_v, loop_w, nl, collapsed));
+            loop_v.n = loop_w.n = nl;
+        }
+        const uint64_t M_noLoops = off[N], nl = loop_v.size();
+        if (dedup!=Dedup::None) fprintf(stderr, "dedup: collapsed %llu duplicate edges\n", (unsigned long long)collapsed);
+        if (orient) orient_edges(N, off, upper_nei, upper_w);
+
+        if (partitions) write_partitions(uniq, off, upper_nei, upper_w, loop_v, loop_w);
+        else {
+            // Write binary file
+            BinWriter bw(out_path);
+            GraphWriter gw(bw, orient, wide);
+            gw.header(N, M_noLoops + nl);
+            gw.mapping(uniq.data(), N);
+            if (in) encode_numa(gw, in->nb, N, off, upper_nei, upper_w);
+            else for (uint32_t i=0;i<N;++i) gw.row(i, upper_nei.data()+off[i], upper_w.data()+off[i], uint64_t(off[i+1]-off[i]));
+            gw.loops_begin(nl);
+            for (uint64_t k=0;k<nl;++k) gw.loop(loop_v[k], loop_w[k]);
+            gw.finish();
+        }
+        if (in) in->nb.report();
+        if (mem_stats) faults.report("serialize", lines);
+    }
+
+    // Sorts rows [lo, hi) of a filled CSR whose row i ends at off[i+1] and whose row lo starts at b,
+    // permuting weights accordingly, and compacts them towards b: off[i] is rewritten for lo < i < hi
+    // (off[lo] already holds b). Each row's loops (neighbor == i) move to loop_v/loop_w from nl on;
+    // with --dedup, duplicate neighbors and repeated loops are collapsed. Returns the end of row hi-1.
+    template<class W, class Off>
+    uint64_t sort_rows(uint32_t lo, uint32_t hi, uint64_t b, Span<Off> off, Span<uint32_t> upper_nei, Span<W> upper_w,
+                       Span<uint32_t> loop_v, Span<W> loop_w, uint64_t &nl, uint64_t &collapsed) const {
+        vector<pair<uint32_t,W>> tmp; tmp.reserve(32);
+        uint64_t wp = b;
+        for (uint32_t i=lo;i<hi;++i){
+            uint64_t e = off[i+1];
             size_t len = (size_t)(e-b);
-            if (len<=1) continue;
-            if (tmp.capacity() < len) tmp.reserve(len);
-            tmp.clear();
-            for (uint64_t k=b;k<e;++k) tmp.emplace_back(upper_nei[k], upper_w[k]);
-            std::sort(tmp.begin(), tmp.end(), [](auto &x, auto &y){ return x.first < y.first; });
-            for (size_t t=0;t<len;++t){ upper_nei[b+t] = tmp[t].first; upper_w[b+t] = tmp[t].second; }
+            if (i!=lo) off[i] = Off(wp);
+            if (len==1 && upper_nei[b]!=i){
+                if (wp!=b){ upper_nei[wp] = upper_nei[b]; upper_w[wp] = upper_w[b]; }
+                ++wp; b = e;
+                continue;
+            }
+            // loops leave the row in input order; --dedup folds them into the first
+            if (tmp.size() < len) tmp.resize(len);
+            size_t m = 0;
+            const uint64_t nl0 = nl;
+            for (size_t t=0;t<len;++t){
+                if (upper_nei[b+t]!=i) tmp[m++] = {upper_nei[b+t], upper_w[b+t]};
+                else if (nl==nl0 || dedup==Dedup::None){ loop_v[nl] = i; loop_w[nl] = upper_w[b+t]; ++nl; }
+                else { merge_weight(loop_w[nl0], upper_w[b+t], dedup); ++collapsed; }
+            }
+            if (dedup==Dedup::None) std::sort(tmp.begin(), tmp.begin()+m, [](auto &x, auto &y){ return x.first < y.first; });
+            else {
+                // stable: equal neighbors stay in input order for --dedup=first
+                std::stable_sort(tmp.begin(), tmp.begin()+m, [](auto &x, auto &y){ return x.first < y.first; });
+                const size_t kept = collapse_duplicates(tmp.data(), m, dedup);
+                collapsed += m - kept;
+                m = kept;
+            }
+            for (size_t t=0;t<m;++t){ upper_nei[wp] = tmp[t].first; upper_w[wp] = tmp[t].second; ++wp; }
+            b = e;
         }
+        return wp;
+    }
 
-        // Sort loops by vertex ascending for delta coding
-        std::sort(loops.begin(), loops.end(), [](auto &x, auto &y){ return x.first < y.first; });
+    // --numa: passes 2 and 3 over the parsed runs, on the pinned workers. Each worker renumbers its
+    // own runs and counts rows with atomic adds; rows are then cut into T ranges with balanced edge
+    // counts, worker t owning range t (so each node owns a contiguous range), and every worker
+    // hands its edges to their owners in input order. An owner first-touches its share of
+    // upper_nei/upper_w, fills and sorts only its own rows; the gaps --dedup and loops leave between
+    // ranges are closed last. The result matches the serial passes exactly.
+    template<class W, class Off>
+    void build_numa(NumaIngest<W> &in, Arena &arena, Span<Off> off, Span<uint32_t> &upper_nei, Span<W> &upper_w,
+                    Span<uint32_t> &loop_v, Span<W> &loop_w, uint64_t &collapsed){
+        using Edge = ScatterEdge<W>;
+        const uint32_t N = uint32_t(off.size() - 2);
+        NumaBuild &nb = in.nb;
+        const vector<unsigned> &node_of = nb.node_of;
+        const unsigned T = unsigned(node_of.size());
+        vector<EdgeRuns<Edge>> &parsed = in.parsed;
 
-        // Write binary file
-        BinWriter bw(out_path);
-        // header (v2)
-        bw.write("GRPH",4); bw.put(2); bw.put(1); // version=2, little-endian
-        bw.varu(N);
-        uint64_t M_total = M_noLoops + loops.size();
-        bw.varu(M_total);
+        // Pass 2: renumber and count rows (off zeroed in worker slices, so it is spread over the nodes)
+        nb.topo.run(node_of, [&](unsigned t){
+            std::fill(off.begin() + (off.size()*t/T), off.begin() + (off.size()*(t+1)/T), Off(0));
+        });
+        nb.topo.run(node_of, [&](unsigned t){
+            for (auto &chunk : parsed[t]) for (Edge &e : chunk){
+                const uint32_t a = in.rank[e.u], b = in.rank[e.v];
+                e.u = min(a,b); e.v = max(a,b);
+                __atomic_fetch_add(&off[e.u+2], Off(1), __ATOMIC_RELAXED);
+            }
+        });
+        vector<uint32_t>().swap(in.rank);
+        for (uint32_t i=2;i<=N+1;++i) off[i] += off[i-1];
+        const uint64_t M = off[N+1];
+        nb.edges = M;
+        nb.cut.assign(T+1, N); nb.cut[0] = 0;
+        for (unsigned t=1;t<T;++t){
+            const uint64_t target = (uint64_t)((__uint128_t)M * t / T);
+            nb.cut[t] = (uint32_t)(std::lower_bound(off.begin()+1+nb.cut[t-1], off.begin()+1+N, target, [](Off x, uint64_t y){ return x < y; }) - (off.begin()+1));
+        }
+        const vector<uint32_t> &cut = nb.cut;
 
-        // mapping newId->originalId (delta + VarUInt)
-        if (N>0){
-            bw.u32le(uniq[0]);
-            for (uint32_t i=1;i<N;++i){
-                uint32_t d = uniq[i] - uniq[i-1];
-                bw.varu(d);
+        // Hand-off: worker t splits its runs by owner, freeing every chunk once copied
+        vector<vector<EdgeRuns<Edge>>> to(T, vector<EdgeRuns<Edge>>(T));
+        vector<vector<uint64_t>> loops_to(T, vector<uint64_t>(T, 0));
+        vector<uint64_t> crossed(T, 0);
+        nb.topo.run(node_of, [&](unsigned t){
+            for (auto &chunk : parsed[t]){
+                for (const Edge &e : chunk){
+                    const unsigned o = unsigned(std::upper_bound(cut.begin(), cut.end(), e.u) - cut.begin()) - 1;
+                    push_run(to[t][o], e);
+                    loops_to[t][o] += e.u == e.v;
+                    crossed[t] += node_of[o] != node_of[t];
+                }
+                vector<Edge>().swap(chunk);
             }
+        });
+        for (uint64_t c : crossed) nb.crossed += c;
+
+        upper_nei = arena.keep<uint32_t>(M);
+        upper_w   = arena.keep<W>(M);
+        vector<uint64_t> lbase(T+1, 0), rb(T+1, M), ends(T), lend(T), coll(T, 0);
+        for (unsigned o=0;o<T;++o){
+            lbase[o+1] = lbase[o];
+            for (unsigned t=0;t<T;++t) lbase[o+1] += loops_to[t][o];
+            rb[o] = off[cut[o]+1]; // start of row cut[o]
         }
+        loop_v = arena.keep<uint32_t>(lbase[T]);
+        loop_w = arena.keep<W>(lbase[T]);
 
-        // upper adjacency lists with varints and 1B weights
-        for (uint32_t i=0;i<N;++i){
-            uint64_t b = off[i], e = off[i+1];
-            uint64_t deg = e - b;
-            bw.varu(deg);
-            uint32_t prev = i; // delta base is current vertex index
-            for (uint64_t k=b; k<e; ++k){
-                uint32_t j = upper_nei[k];
-                uint32_t gap = j - prev; // j>prev
-                bw.varu(gap);
-                bw.put(upper_w[k]);
-                prev = j;
-            }
-        }
-
-        // loops section
-        bw.varu((uint64_t)loops.size());
-        uint32_t prevLoop = 0;
-        for (auto &lw : loops){
-            uint32_t v = lw.first; uint8_t w = lw.second;
-            uint32_t delta = v - prevLoop;
-            bw.varu(delta);
-            bw.put(w);
-            prevLoop = v;
+        // Pass 3 per owner: first touch, fill in input order, sort
+        vector<uint64_t> local(T, 0), seen(T, 0);
+        nb.topo.run(node_of, [&](unsigned o){
+            memset(upper_nei.data() + rb[o], 0, (rb[o+1]-rb[o]) * sizeof(uint32_t));
+            memset(upper_w.data() + rb[o], 0, (rb[o+1]-rb[o]) * sizeof(W));
+            for (unsigned t=0;t<T;++t){
+                for (auto &chunk : to[t][o]){
+                    for (const Edge &e : chunk){ const Off pos = off[e.u+1]++; upper_nei[pos] = e.v; upper_w[pos] = e.w; }
+                    vector<Edge>().swap(chunk);
+                }
+            }
+            pages_on_node(upper_nei.data() + rb[o], upper_nei.data() + rb[o+1], int(node_of[o]), 64, local[o], seen[o]);
+            uint64_t nl = lbase[o];
+            ends[o] = sort_rows(cut[o], cut[o+1], rb[o], off, upper_nei, upper_w, loop_v, loop_w, nl, coll[o]);
+            lend[o] = nl;
+        });
+        for (unsigned o=0;o<T;++o){ nb.pages_local += local[o]; nb.pages_seen += seen[o]; collapsed += coll[o]; }
+
+        // Close the gaps between owners' ranges (rows and loops), in owner order
+        uint64_t wp = ends[0], nl = lend[0];
+        for (unsigned o=1;o<T;++o){
+            const uint64_t len = ends[o] - rb[o], shift = rb[o] - wp;
+            if (shift){
+                memmove(upper_nei.data() + wp, upper_nei.data() + rb[o], len * sizeof(uint32_t));
+                memmove(upper_w.data() + wp, upper_w.data() + rb[o], len * sizeof(W));
+                for (uint32_t i=cut[o];i<cut[o+1];++i) off[i] -= Off(shift);
+            }
+            wp += len;
+            const uint64_t ln = lend[o] - lbase[o];
+            if (nl != lbase[o]){
+                memmove(loop_v.data() + nl, loop_v.data() + lbase[o], ln * sizeof(uint32_t));
+                memmove(loop_w.data() + nl, loop_w.data() + lbase[o], ln * sizeof(W));
+            }
+            nl += ln;
         }
+        off[N] = Off(wp);
+        loop_v.n = loop_w.n = nl;
+    }
 
-        bw.flush();
+    // --numa: each worker encodes the runs of whole blocks that start in its row range into memory,
+    // on its own node; the runs are then appended in order, so the file is the serial one.
+    template<class W, class Off>
+    void encode_numa(GraphWriter &gw, NumaBuild &nb, uint32_t N, Span<Off> off, Span<uint32_t> upper_nei, Span<W> upper_w){
+        const unsigned T = unsigned(nb.node_of.size());
+        const vector<uint32_t> starts = BlockIndexBuilder::starts(N, [&](uint32_t i){ return uint64_t(off[i+1]-off[i]); });
+        vector<uint32_t> from(T+1, N);
+        for (unsigned t=0;t<T;++t){
+            auto it = std::lower_bound(starts.begin(), starts.end(), nb.cut[t]);
+            from[t] = it == starts.end() ? N : *it;
+        }
+        vector<BinWriter> seg(T);
+        vector<BlockIndexBuilder> idx(T);
+        nb.topo.run(nb.node_of, [&](unsigned t){
+            GraphWriter sw(seg[t], gw.oriented, gw.wide);
+            for (uint32_t i=from[t];i<from[t+1];++i) sw.row(i, upper_nei.data()+off[i], upper_w.data()+off[i], uint64_t(off[i+1]-off[i]));
+            idx[t] = std::move(sw.index);
+        });
+        for (unsigned t=0;t<T;++t){
+            gw.rows_from(seg[t], idx[t]);
+            vector<unsigned char>().swap(seg[t].buf);
+        }
     }
-};
 
-// ========================= Core: deserialize =========================
-struct Deserializer {
-    string in_path, out_path;
-    void run(){
+    // --orient: re-stores every edge at whichever endpoint is removed first in a min-degree peeling
+    // (degeneracy) order, so no row keeps more neighbors than the graph's degeneracy and hub rows
+    // shrink to their low-degree share. The orientation is acyclic, which --triangles relies on.
+    // Rows stay sorted: row s receives its sources i<s first (ascending i), then its own j>s.
+    template<class W, class Off>
+    void orient_edges(uint32_t N, Span<Off> off, Span<uint32_t> nei, Span<W> w){
+        const uint64_t M = off[N];
+        vector<uint64_t> deg(N, 0);
+        for (uint32_t i=0;i<N;++i){ deg[i] += off[i+1]-off[i]; for (uint64_t k=off[i];k<off[i+1];++k) ++deg[nei[k]]; }
+        vector<uint64_t> aoff(N+1, 0);
+        uint64_t maxd = 0, before = 0;
+        for (uint32_t v=0;v<N;++v){ aoff[v+1] = aoff[v] + deg[v]; maxd = max(maxd, deg[v]); before = max(before, uint64_t(off[v+1]-off[v])); }
+        vector<uint32_t> adj(2*M);
+        {
+            vector<uint64_t> at(aoff.begin(), aoff.end()-1);
+            for (uint32_t i=0;i<N;++i) for (uint64_t k=off[i];k<off[i+1];++k){ adj[at[i]++] = nei[k]; adj[at[nei[k]]++] = i; }
+        }
+        // Batagelj-Zaversnik bucket peeling; rank[v] = position of v in the removal order
+        vector<uint64_t> bin(maxd+2, 0);
+        vector<uint32_t> vert(N), pos(N), rank(N);
+        for (uint32_t v=0;v<N;++v) ++bin[deg[v]+1];
+        for (uint64_t d=0;d<=maxd;++d) bin[d+1] += bin[d];
+        for (uint32_t v=0;v<N;++v){ pos[v] = (uint32_t)bin[deg[v]]++; vert[pos[v]] = v; }
+        for (uint64_t d=maxd+1;d>0;--d) bin[d] = bin[d-1];
+        bin[0] = 0;
+        for (uint32_t r=0;r<N;++r){
+            const uint32_t v = vert[r];
+            rank[v] = r;
+            for (uint64_t k=aoff[v];k<aoff[v+1];++k){
+                const uint32_t u = adj[k];
+                if (deg[u] <= deg[v]) continue; // removed already, or stays in v's bucket
+                const uint64_t du = deg[u];
+                const uint32_t pu = pos[u], pw = (uint32_t)bin[du], x = vert[pw];
+                if (u != x){ pos[u] = pw; vert[pu] = x; pos[x] = pu; vert[pw] = u; }
+                ++bin[du]; --deg[u];
+            }
+        }
+        vector<uint32_t>().swap(adj);
+
+        vector<uint64_t> noff(N+1, 0);
+        for (uint32_t i=0;i<N;++i) for (uint64_t k=off[i];k<off[i+1];++k) ++noff[(rank[i] < rank[nei[k]] ? i : nei[k]) + 1];
+        for (uint32_t v=0;v<N;++v) noff[v+1] += noff[v];
+        vector<uint32_t> nnei(M); vector<W> nw(M);
+        vector<uint64_t> at(noff.begin(), noff.end()-1);
+        uint64_t after = 0;
+        for (uint32_t i=0;i<N;++i) for (uint64_t k=off[i];k<off[i+1];++k){
+            const uint32_t j = nei[k];
+            const uint64_t slot = rank[i] < rank[j] ? at[i]++ : at[j]++;
+            nnei[slot] = rank[i] < rank[j] ? j : i; nw[slot] = w[k];
+        }
+        for (uint32_t v=0;v<N;++v) after = max(after, noff[v+1]-noff[v]);
+        std::copy(noff.begin(), noff.end(), off.begin());
+        std::copy(nnei.begin(), nnei.end(), nei.begin());
+        std::copy(nw.begin(), nw.end(), w.begin());
+        fprintf(stderr, "orient: max row degree %llu -> %llu\n", (unsigned long long)before, (unsigned long long)after);
+    }
+
+    // Splits the new-id space into P ranges with balanced upper-edge counts. Partition p is a
+    // standalone v3 file holding the rows (and loops) of its range, renumbered over the vertices
+    // those edges touch, so `-d` on it yields exactly its share of the edges. Partitions are encoded
+    // concurrently; manifest.tsv lists each file with its range.
+    template<class Id, class W, class Off>
+    void write_partitions(Span<Id> uniq, Span<Off> off, Span<uint32_t> upper_nei, Span<W> upper_w, Span<uint32_t> loop_v, Span<W> loop_w){
+        constexpr uint8_t wide = (sizeof(Id) == 8 ? kFlagWideIds : 0) | (sizeof(W) == 2 ? kFlagWideWeights : 0);
+        if (::mkdir(out_path.c_str(), 0755) != 0 && errno != EEXIST) die("cannot create output directory: " + out_path);
+        const uint32_t N = (uint32_t)uniq.size();
+        const uint64_t M = off[N];
+        vector<uint32_t> cut(partitions+1, N); cut[0] = 0;
+        for (unsigned p=1;p<partitions;++p){
+            uint64_t target = (uint64_t)((__uint128_t)M * p / partitions);
+            cut[p] = (uint32_t)(std::lower_bound(off.begin()+cut[p-1], off.begin()+N, target, [](Off x, uint64_t t){ return x < t; }) - off.begin());
+        }
+        auto part_name = [](unsigned p){ char name[32]; snprintf(name, sizeof(name), "part-%05u.bin", p); return string(name); };
+        const string dir = out_path + (out_path.back()=='/' ? "" : "/");
+        vector<uint32_t> part_n(partitions); vector<uint64_t> part_m(partitions);
+
+        parallel_for(partitions, 1, [&](uint64_t pb, uint64_t pe){
+            vector<uint32_t> local, nei;
+            for (uint64_t p=pb;p<pe;++p){
+                const uint32_t lo = cut[p], hi = cut[p+1];
+                const size_t lb = size_t(std::lower_bound(loop_v.begin(), loop_v.end(), lo) - loop_v.begin());
+                const size_t le = size_t(std::lower_bound(loop_v.begin()+lb, loop_v.end(), hi) - loop_v.begin());
+                // global ids referenced by this partition, ascending = its local new-id order
+                local.clear();
+                for (uint32_t i=lo;i<hi;++i) if (off[i+1]>off[i]) local.push_back(i);
+                local.insert(local.end(), upper_nei.begin()+off[lo], upper_nei.begin()+off[hi]);
+                local.insert(local.end(), loop_v.begin()+lb, loop_v.begin()+le);
+                sort(local.begin(), local.end()); local.erase(unique(local.begin(), local.end()), local.end());
+                const uint32_t n = (uint32_t)local.size();
+                auto local_of = [&](uint32_t gid){ return (uint32_t)(std::lower_bound(local.begin(), local.end(), gid) - local.begin()); };
+
+                vector<Id> orig(n);
+                for (uint32_t x=0;x<n;++x) orig[x] = uniq[local[x]];
+                BinWriter bw(dir + part_name((unsigned)p));
+                GraphWriter gw(bw, orient, wide);
+                part_n[p] = n; part_m[p] = uint64_t(off[hi]-off[lo]) + (le-lb);
+                gw.header(n, part_m[p]);
+                gw.mapping(orig.data(), n);
+                for (uint32_t x=0;x<n;++x){
+                    const uint32_t gid = local[x];
+                    if (gid<lo || gid>=hi){ gw.row(x, nullptr, (const W*)nullptr, 0); continue; }
+                    const uint64_t b = off[gid], e = off[gid+1];
+                    nei.resize(e-b);
+                    for (uint64_t k=b;k<e;++k) nei[k-b] = local_of(upper_nei[k]);
+                    gw.row(x, nei.data(), upper_w.data()+b, e-b);
+                }
+                gw.loops_begin(le-lb);
+                for (size_t k=lb;k<le;++k) gw.loop(local_of(loop_v[k]), loop_w[k]);
+                gw.finish();
+            }
+        });
+
+        TextWriter mf(dir + "manifest.tsv");
+        const char* hdr = "part\tfile\tfirst_new_id\tend_new_id\tfirst_orig_id\tlast_orig_id\tvertices\tedges\n";
+        mf.puts(hdr, strlen(hdr));
+        for (unsigned p=0;p<partitions;++p){
+            const string name = part_name(p);
+            mf.putu(p); mf.put('\t'); mf.puts(name.data(), name.size()); mf.put('\t');
+            mf.putu(cut[p]); mf.put('\t'); mf.putu(cut[p+1]); mf.put('\t');
+            if (cut[p] < cut[p+1]){ mf.putu(uniq[cut[p]]); mf.put('\t'); mf.putu(uniq[cut[p+1]-1]); mf.put('\t'); }
+            else { mf.puts("-\t-\t", 4); }
+            mf.putu(part_n[p]); mf.put('\t');
+            char tmp[24]; auto r = std::to_chars(tmp, tmp+24, part_m[p]); mf.puts(tmp, r.ptr-tmp); mf.newline();
+        }
+        mf.flush();
+    }
+};
+
+// In-place inclusive prefix sum a[k] = base + a[0] + ... + a[k] (mod 2^32): turns a row's decoded
+// gaps into absolute neighbor ids. The SIMD variants do log-step shifted adds within a vector and
+// carry the running total across vectors as a broadcast of the last lane.
+static void prefix_sum_scalar(uint32_t* a, size_t n, uint32_t base){
+    for (size_t k=0; k<n; ++k){ base += a[k]; a[k] = base; }
+}
+#if defined(__SSE2__)
+static void prefix_sum_sse2(uint32_t* a, size_t n, uint32_t base){
+    size_t k = 0;
+    __m128i carry = _mm_set1_epi32((int)base);
+    for (; k+4<=n; k+=4){
+        __m128i x = _mm_loadu_si128((const __m128i*)(a+k));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        _mm_storeu_si128((__m128i*)(a+k), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3,3,3,3));
+    }
+    if (k) base = a[k-1];
+    prefix_sum_scalar(a+k, n-k, base);
+}
+#endif
+#if GRAPH_X86
+TARGET("avx2") static void prefix_sum_avx2(uint32_t* a, size_t n, uint32_t base){
+    size_t k = 0;
+    __m256i carry = _mm256_set1_epi32((int)base);
+    const __m256i last_lo = _mm256_set1_epi32(3), last = _mm256_set1_epi32(7);
+    for (; k+8<=n; k+=8){
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a+k));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4)); // byte shifts stay within 128-bit lanes
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        x = _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(), _mm256_permutevar8x32_epi32(x, last_lo), 0xF0));
+        x = _mm256_add_epi32(x, carry);
+        _mm256_storeu_si256((__m256i*)(a+k), x);
+        carry = _mm256_permutevar8x32_epi32(x, last);
+    }
+    if (k) base = a[k-1];
+    prefix_sum_scalar(a+k, n-k, base);
+}
+TARGET("avx512f") static void prefix_sum_avx512(uint32_t* a, size_t n, uint32_t base){
+    size_t k = 0;
+    __m512i carry = _mm512_set1_epi32((int)base);
+    const __m512i iota = _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15), last = _mm512_set1_epi32(15);
+    const __m512i s1 = _mm512_sub_epi32(iota, _mm512_set1_epi32(1)), s2 = _mm512_sub_epi32(iota, _mm512_set1_epi32(2));
+    const __m512i s4 = _mm512_sub_epi32(iota, _mm512_set1_epi32(4)), s8 = _mm512_sub_epi32(iota, _mm512_set1_epi32(8));
+    for (; k+16<=n; k+=16){
+        __m512i x = _mm512_loadu_si512((const void*)(a+k));
+        x = _mm512_add_epi32(x, _mm512_maskz_permutexvar_epi32(0xFFFE, s1, x)); // lane j += lane j-1
+        x = _mm512_add_epi32(x, _mm512_maskz_permutexvar_epi32(0xFFFC, s2, x));
+        x = _mm512_add_epi32(x, _mm512_maskz_permutexvar_epi32(0xFFF0, s4, x));
+        x = _mm512_add_epi32(x, _mm512_maskz_permutexvar_epi32(0xFF00, s8, x));
+        x = _mm512_add_epi32(x, carry);
+        _mm512_storeu_si512((void*)(a+k), x);
+        carry = _mm512_maskz_permutexvar_epi32(0xFFFF, last, x); // broadcast lane 15
+    }
+    if (k) base = a[k-1];
+    prefix_sum_scalar(a+k, n-k, base);
+}
+#endif
+
+// Decodes the gap/weight pairs k..deg-1 of a gap row into nei/w (gaps, before the prefix sum) and
+// adds the gaps to `span`, as long as a maximal pair surely fits before e; returns the next k and
+// leaves the rest to the caller's checked loop. The scalar loop serves every weight width; the
+// SIMD variants take 8-bit weights. They look the continuation bits of the next 8 bytes up in
+// GapPairTable, whose PSHUFB controls spread up to four pairs with 1..4-byte gaps into 32-bit lanes
+// and pick out their weights, so mixed gap lengths cost no branches; a window starting with a
+// 5-byte gap takes one scalar step. AVX2 and AVX-512 also take 16 or 32 pairs of 1-byte gaps at once.
+template<class Weight>
+static inline uint64_t decode_gaps_t(const uint8_t*& p, const uint8_t* e, uint32_t* nei, typename Weight::type* w,
+                                     uint64_t k, uint64_t deg, uint64_t &span){
+    const uint8_t* q = p;
+    for (; k<deg && size_t(e - q) >= 5 + Weight::bytes; ++k){
+        uint32_t x = 0; unsigned sh = 0; uint8_t b;
+        do { b = *q++; x |= uint32_t(b & 0x7F) << sh; sh += 7; } while ((b & 0x80) && sh < 35);
+        if (b & 0x80) die("corrupt adjacency row (gap exceeds 32 bits)");
+        nei[k] = x; span += x; w[k] = Weight::load(q); q += Weight::bytes;
+    }
+    p = q;
+    return k;
+}
+static uint64_t decode_gaps_scalar(const uint8_t*& p, const uint8_t* e, uint32_t* nei, uint8_t* w, uint64_t k, uint64_t deg, uint64_t &span){
+    return decode_gaps_t<WeightU8>(p, e, nei, w, k, deg, span);
+}
+#if GRAPH_X86
+struct GapPairTable {
+    alignas(16) uint8_t shuf[256][16]; // lane n = the bytes of gap n, zero-padded to 4; unused lanes 0
+    uint32_t wshuf[256];               // byte n = position of weight n
+    uint8_t pairs[256], bytes[256];
+    GapPairTable(){
+        for (unsigned m=0;m<256;++m){
+            memset(shuf[m], 0x80, 16); wshuf[m] = 0x80808080u;
+            unsigned pos = 0, n = 0;
+            for (; n<4; ++n){
+                unsigned end = pos;
+                while (end < 8 && (m >> end & 1)) ++end;
+                if (end - pos >= 4 || end + 1 >= 8) break; // gap over 4 bytes or pair not inside the window
+                for (unsigned b=pos;b<=end;++b) shuf[m][4*n + b - pos] = uint8_t(b);
+                wshuf[m] = (wshuf[m] & ~(0xFFu << 8*n)) | (end + 1) << 8*n;
+                pos = end + 2;
+            }
+            pairs[m] = uint8_t(n); bytes[m] = uint8_t(pos);
+        }
+    }
+};
+static const GapPairTable g_gap_pairs;
+
+// One table step on the 16 bytes v at q: decodes g_gap_pairs.pairs[m] (0..4) pairs into nei/w + k,
+// storing all four lanes (the caller guarantees k + 4 <= deg); returns the pair count and advances q.
+TARGET("sse4.2") static inline unsigned decode_gap_window(__m128i v, const uint8_t*& q, uint32_t* nei, uint8_t* w, uint64_t k, __m128i &acc){
+    const unsigned m = unsigned(_mm_movemask_epi8(v)) & 0xFF;
+    const __m128i x = _mm_shuffle_epi8(v, _mm_load_si128((const __m128i*)g_gap_pairs.shuf[m]));
+    const __m128i g = _mm_or_si128(_mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0x7F)), _mm_and_si128(_mm_srli_epi32(x, 1), _mm_set1_epi32(0x3F80))),
+                                   _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 2), _mm_set1_epi32(0x1FC000)), _mm_and_si128(_mm_srli_epi32(x, 3), _mm_set1_epi32(0xFE00000))));
+    _mm_storeu_si128((__m128i*)(nei + k), g);
+    const uint32_t ws = (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi8(v, _mm_cvtsi32_si128((int)g_gap_pairs.wshuf[m])));
+    memcpy(w + k, &ws, 4);
+    acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_cvtepu32_epi64(g), _mm_cvtepu32_epi64(_mm_srli_si128(g, 8))));
+    q += g_gap_pairs.bytes[m];
+    return g_gap_pairs.pairs[m];
+}
+TARGET("sse4.2") static uint64_t decode_gaps_sse42(const uint8_t*& p, const uint8_t* e, uint32_t* nei, uint8_t* w, uint64_t k, uint64_t deg, uint64_t &span){
+    const uint8_t* q = p;
+    __m128i acc = _mm_setzero_si128();
+    while (k+4 <= deg && e - q >= 16){
+        const unsigned n = decode_gap_window(_mm_loadu_si128((const __m128i*)q), q, nei, w, k, acc);
+        k = n ? k + n : decode_gaps_t<WeightU8>(q, e, nei, w, k, k+1, span);
+    }
+    span += uint64_t(_mm_cvtsi128_si64(acc)) + uint64_t(_mm_extract_epi64(acc, 1));
+    p = q;
+    return decode_gaps_t<WeightU8>(p, e, nei, w, k, deg, span);
+}
+// The wide variants try the all-1-byte block only at the start and after a window of four 1-byte
+// gaps, so rows of mixed lengths do not pay for a probe that keeps failing.
+TARGET("avx2") static uint64_t decode_gaps_avx2(const uint8_t*& p, const uint8_t* e, uint32_t* nei, uint8_t* w, uint64_t k, uint64_t deg, uint64_t &span){
+    const uint8_t* q = p;
+    __m128i acc = _mm_setzero_si128();
+    const __m256i lo = _mm256_set1_epi16(0xFF);
+    bool dense = true;
+    while (k+4 <= deg && e - q >= 32){
+        if (dense && k+16 <= deg){
+            const __m256i v = _mm256_loadu_si256((const __m256i*)q);
+            if (!(unsigned(_mm256_movemask_epi8(v)) & 0x55555555u)){
+                // 16 pairs with 1-byte gaps: gap bytes to the low half, weights to the high half
+                const __m256i gw = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(v, lo), _mm256_srli_epi16(v, 8)), 0xD8);
+                const __m128i g = _mm256_castsi256_si128(gw);
+                _mm256_storeu_si256((__m256i*)(nei + k), _mm256_cvtepu8_epi32(g));
+                _mm256_storeu_si256((__m256i*)(nei + k + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(g, 8)));
+                _mm_storeu_si128((__m128i*)(w + k), _mm256_extracti128_si256(gw, 1));
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(g, _mm_setzero_si128()));
+                k += 16; q += 32;
+                continue;
+            }
+        }
+        const unsigned n = decode_gap_window(_mm_loadu_si128((const __m128i*)q), q, nei, w, k, acc);
+        k = n ? k + n : decode_gaps_t<WeightU8>(q, e, nei, w, k, k+1, span);
+        dense = n == 4; // four pairs fit the 8-byte window only with 1-byte gaps
+    }
+    span += uint64_t(_mm_cvtsi128_si64(acc)) + uint64_t(_mm_extract_epi64(acc, 1));
+    p = q;
+    return decode_gaps_sse42(p, e, nei, w, k, deg, span);
+}
+TARGET("avx512bw,avx512vl") static uint64_t decode_gaps_avx512(const uint8_t*& p, const uint8_t* e, uint32_t* nei, uint8_t* w, uint64_t k, uint64_t deg, uint64_t &span){
+    const uint8_t* q = p;
+    __m128i acc = _mm_setzero_si128();
+    __m256i acc32 = _mm256_setzero_si256();
+    bool dense = true;
+    while (k+4 <= deg && e - q >= 64){
+        if (dense && k+32 <= deg){
+            const __m512i v = _mm512_loadu_si512((const void*)q);
+            if (!(_mm512_movepi8_mask(v) & 0x5555555555555555ull)){
+                // 32 pairs with 1-byte gaps: the low and high bytes of the 16-bit pairs are the gaps and weights
+                // (zero-masked forms: GCC 12 flags the unmasked ones' undefined pass-through as uninitialized)
+                const __m256i g = _mm512_maskz_cvtepi16_epi8(~0u, v);
+                _mm512_storeu_si512((void*)(nei + k), _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm256_castsi256_si128(g)));
+                _mm512_storeu_si512((void*)(nei + k + 16), _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm256_extracti128_si256(g, 1)));
+                _mm256_storeu_si256((__m256i*)(w + k), _mm512_maskz_cvtepi16_epi8(~0u, _mm512_srli_epi16(v, 8)));
+                acc32 = _mm256_add_epi64(acc32, _mm256_sad_epu8(g, _mm256_setzero_si256()));
+                k += 32; q += 64;
+                continue;
+            }
+        }
+        const unsigned n = decode_gap_window(_mm_loadu_si128((const __m128i*)q), q, nei, w, k, acc);
+        k = n ? k + n : decode_gaps_t<WeightU8>(q, e, nei, w, k, k+1, span);
+        dense = n == 4; // four pairs fit the 8-byte window only with 1-byte gaps
+    }
+    acc = _mm_add_epi64(acc, _mm_add_epi64(_mm256_castsi256_si128(acc32), _mm256_extracti128_si256(acc32, 1)));
+    span += uint64_t(_mm_cvtsi128_si64(acc)) + uint64_t(_mm_extract_epi64(acc, 1));
+    p = q;
+    return decode_gaps_sse42(p, e, nei, w, k, deg, span);
+}
+#endif
+
+// Decodes the Section B row of vertex i into nei/w, growing them as needed; returns deg_plus(i).
+// Gap rows are unpacked in two steps: the decode_gaps kernel (without per-byte bounds checks away
+// from the end of the buffer) puts gaps and weights in nei/w, then prefix_sum turns gaps into neighbor ids.
+// `flags` are the file's format flags: without kFlagRowCodecs every row is gap/weight pairs.
+// Every decoded neighbor is checked against the vertex count N, so a corrupt row dies instead of
+// indexing past the mapping. read_row_t is the decoder for one RowFormat; read_row picks it from
+// the file flags per call and only takes 8-bit weights (merge and patch reject kFlagWideWeights files).
+template<class Fmt>
+static inline uint64_t read_row_t(BinReader &br, uint32_t N, uint32_t i, vector<uint32_t> &nei, vector<typename Fmt::weight::type> &w){
+    using First = typename Fmt::first;
+    using Weight = typename Fmt::weight;
+    uint64_t deg = br.varu();
+    unsigned codec = kRowGaps;
+    if constexpr (Fmt::rows::tagged){ codec = deg & 3; deg >>= 2; }
+    if (deg > size_t(br.e - br.p) / (codec==kRowGaps ? 1 + Weight::bytes : Weight::bytes)) die("corrupt adjacency row (degree exceeds remaining data)");
+    if (nei.size() < deg){ nei.resize(deg); w.resize(deg); }
+    if (codec == kRowGaps){
+        if (!deg) return 0;
+        const uint32_t first = First::decode(i, br.varu());
+        w[0] = Weight::get(br); nei[0] = 0;
+        uint64_t k, span = 0; // rows ascend, so first + the sum of the gaps bounds every neighbor
+        if constexpr (Weight::bytes == 1) k = g_kernels.decode_gaps(br.p, br.e, nei.data(), w.data(), 1, deg, span);
+        else k = decode_gaps_t<Weight>(br.p, br.e, nei.data(), w.data(), 1, deg, span);
+        for (; k<deg; ++k){
+            nei[k] = (uint32_t)br.varu(); span += nei[k];
+            w[k] = Weight::get(br);
+        }
+        if (first + span >= N) die("corrupt adjacency row (neighbor out of range)");
+        g_kernels.prefix_sum(nei.data(), deg, first);
+        return deg;
+    }
+    if constexpr (!Fmt::rows::tagged) return deg; // unreachable: untagged rows are always gaps
+    uint64_t k = 0;
+    if (codec == kRowBitmap){
+        const uint32_t first = First::decode(i, br.varu());
+        const uint64_t span = br.varu();
+        const size_t nb = span/8 + 1;
+        if (span > 0xFFFFFFFFull || !br.has(nb)) die("corrupt adjacency row (bitmap)");
+        if (first + span >= N) die("corrupt adjacency row (neighbor out of range)");
+        for (size_t o=0;o<nb;o+=8){
+            uint64_t word = 0;
+            memcpy(&word, br.p + o, min<size_t>(8, nb-o)); // little-endian: bit b of byte q is position 8q+b
+            for (; word; word &= word-1){
+                if (k == deg) die("corrupt adjacency row (bitmap)");
+                nei[k++] = first + uint32_t(o*8 + __builtin_ctzll(word));
+            }
+        }
+        br.p += nb;
+    } else if (codec == kRowRuns){
+        const uint64_t runs = br.varu();
+        uint64_t prev = 0;
+        for (uint64_t r=0;r<runs;++r){
+            const uint64_t start = r ? prev + br.varu() : First::decode(i, br.varu());
+            const uint64_t len = br.varu() + 1;
+            if (len > deg - k) die("corrupt adjacency row (runs)");
+            if (start + len > N) die("corrupt adjacency row (neighbor out of range)");
+            for (uint64_t q=0;q<len;++q) nei[k++] = uint32_t(start + q);
+            prev = start + len - 1;
+        }
+    } else die("corrupt adjacency row (unknown encoding)");
+    if (k != deg || !br.has(deg * Weight::bytes)) die("corrupt adjacency row (degree mismatch)");
+    memcpy(w.data(), br.p, deg * Weight::bytes); br.p += deg * Weight::bytes; // little-endian host
+    return deg;
+}
+static inline uint64_t read_row(BinReader &br, uint32_t N, uint32_t i, vector<uint32_t> &nei, vector<uint8_t> &w, uint8_t flags){
+    return with_rows<WeightU8>(flags, [&](auto fmt){ return read_row_t<decltype(fmt)>(br, N, i, nei, w); });
+}
+
+// Calls f(i, nei, w, deg) for the rows first..last-1 of an N-vertex graph that br is positioned at,
+// decoding them in a loop instantiated for the RowFormat of `flags`; w points to uint8_t or uint16_t weights.
+template<class F>
+static void for_each_row(BinReader &br, uint8_t flags, uint32_t N, uint32_t first, uint32_t last, F f){
+    with_row_format(flags, [&](auto fmt){
+        using W = typename decltype(fmt)::weight::type;
+        vector<uint32_t> nei; vector<W> w;
+        for (uint32_t i=first;i<last;++i){
+            const uint64_t deg = read_row_t<decltype(fmt)>(br, N, i, nei, w);
+            f(i, (const uint32_t*)nei.data(), (const W*)w.data(), deg);
+        }
+    });
+}
+
+// ========================= Binary graph file (header + mapping) =========================
+// Parses the header and Section A of a v1/v2/v3 file; `adj` points at the first byte of Section B
+// and `end` at the end of Section C. `blocks` always covers all rows: files without Section D get
+// a single block with an unknown (never pruned) summary and `loops` == nullptr.
+// open_graph() may add delta segments: N, M_total, orig_of and blocks then describe the merged
+// graph, while Sections B and C stay the base's own rows in base ids (base row r is merged vertex
+// base_remap[r]). Rows and loops are read through RowReader and for_each_graph_loop, which merge
+// in the segments' rows as they go.
+struct GraphFile {
+    MMap mm;
+    uint8_t version = 0;
+    uint8_t flags = 0;
+    uint32_t N = 0;
+    uint64_t M_total = 0;
+    vector<uint32_t> orig_of;   // newId -> originalId
+    vector<uint64_t> orig_of64; // the same for kFlagWideIds files, whose orig_of stays empty
+    const uint8_t* adj = nullptr;
+    const uint8_t* end = nullptr;
+    const uint8_t* loops = nullptr; // start of Section C when known without decoding Section B
+    vector<BlockSummary> blocks;
+    bool has_index = false;
+    // One delta segment: its file, its local->merged id table, and per merged block the segment's
+    // first row in that block and the row's Section B offset.
+    struct Delta { unique_ptr<GraphFile> g; vector<uint32_t> remap, row; vector<uint64_t> offset; };
+    vector<Delta> deltas;
+    vector<uint32_t> base_remap; // base newId -> merged newId (with deltas)
+    uint32_t base_N = 0;
+    bool base_identity = false;  // base_remap[r] == r: no segment adds a vertex below a base one
+
+    explicit GraphFile(const string &path) : GraphFile(MMap::map_file(path)) {}
+    explicit GraphFile(MMap &&m) : mm(std::move(m)) {
         if (!is_little_endian()) die("host is not little-endian");
-        MMap mm = MMap::map_file(in_path);
-        const char* data = mm.data; size_t sz = mm.sz;
-        if (sz < 4+1+1+4+8) die("binary too small");
-        BinReader br(data, sz);
+        BinReader br(mm.data, mm.sz);
         // header
-        if (!(br.has(4))) die("no magic");
+        if (!(br.has(4+1+1))) die("binary too small");
         if (br.get()!='G' || br.get()!='R' || br.get()!='P' || br.get()!='H') die("bad magic, expected 'GRPH'");
-        uint8_t version = br.get(); if (version!=1 && version!=2) die("unsupported version");
+        version = br.get(); if (version<1 || version>3) die("unsupported version");
         uint8_t endian = br.get(); if (endian!=1) die("unsupported endianness (only little-endian=1)");
-        uint32_t N = 0;
-        uint64_t M_total = 0;
+        if (version>=3){ flags = br.get(); if (flags & ~(kFlagBlockIndex | kFlagRowCodecs | kFlagOriented | kFlagWideIds | kFlagWideWeights)) die("unsupported format flags"); }
         if (version==1){
             N = br.u32le();
-            M_total = br.u64le(); (void)M_total;
+            M_total = br.u64le();
         } else {
             N = (uint32_t)br.varu();
-            M_total = br.varu(); (void)M_total;
+            M_total = br.varu();
         }
 
         // mapping
-        vector<uint32_t> orig_of(N);
-        if (version==1){
-            for (uint32_t i=0;i<N;++i) orig_of[i] = br.u32le();
-        } else {
-            if (N>0){
-                uint32_t first = br.u32le();
-                orig_of[0] = first;
-                for (uint32_t i=1;i<N;++i){
-                    uint64_t d = br.varu();
-                    orig_of[i] = orig_of[i-1] + (uint32_t)d;
-                }
+        if (flags & kFlagWideIds){ orig_of64.resize(N); MappingDelta64::read(br, orig_of64, N); }
+        else { orig_of.resize(N); if (version==1) MappingFixed32::read(br, orig_of, N); else MappingDelta32::read(br, orig_of, N); }
+        adj = br.p; end = br.e;
+        if (flags & kFlagBlockIndex) read_index();
+        else if (N>0){ blocks.emplace_back(); blocks.back().wmin = 0; blocks.back().wmax = 0xFFFF; blocks.back().nmin = 0; blocks.back().nmax = N-1; blocks.back().edges = M_total; }
+    }
+
+    bool wide() const { return flags & (kFlagWideIds | kFlagWideWeights); }
+    template<class Id> const vector<Id>& mapping() const { if constexpr (sizeof(Id) == 8) return orig_of64; else return orig_of; }
+    uint64_t orig(uint32_t v) const { return flags & kFlagWideIds ? orig_of64[v] : orig_of[v]; }
+    // First new id whose original id is >= x (N if none); new ids ascend with original ids.
+    uint32_t lower_orig(uint64_t x) const {
+        if (flags & kFlagWideIds) return uint32_t(std::lower_bound(orig_of64.begin(), orig_of64.end(), x) - orig_of64.begin());
+        if (x > 0xFFFFFFFFull) return N;
+        return uint32_t(std::lower_bound(orig_of.begin(), orig_of.end(), (uint32_t)x) - orig_of.begin());
+    }
+
+    uint32_t block_end(size_t b) const { return b+1 < blocks.size() ? blocks[b+1].first : N; }
+
+    // Gives files without Section D row-range blocks and a Section C pointer by walking Section B
+    // once. Summaries stay unknown (never pruned by weight or neighbor range). Call it before any
+    // delta segments are merged in: it walks the base rows only.
+    void scan_index(){
+        blocks.clear();
+        BinReader br = section_b();
+        for (uint32_t b0=0;b0<N;b0+=BlockIndexBuilder::kBlockVertices){
+            blocks.emplace_back(); BlockSummary &b = blocks.back();
+            b.first = b0; b.offset = uint64_t(br.p - adj); b.wmin = 0; b.wmax = 0xFFFF; b.nmin = 0; b.nmax = N-1;
+            for_each_row(br, flags, N, b0, min<uint64_t>(N, uint64_t(b0) + BlockIndexBuilder::kBlockVertices),
+                         [&](uint32_t, const uint32_t*, const auto*, uint64_t deg){ b.edges += deg; });
+        }
+        loops = br.p;
+    }
+
+    void read_index(){
+        const size_t wb = flags & kFlagWideWeights ? 2 : 1;
+        const size_t kTrailer = 8+8+4+4, kRecord = 4+8+8+2*wb+4+4;
+        if (size_t(end-adj) < kTrailer) die("block index trailer missing");
+        BinReader tr((const char*)end - kTrailer, kTrailer);
+        uint64_t loops_rel = tr.u64le(), d_off = tr.u64le(); uint32_t cnt = tr.u32le();
+        if (memcmp(tr.p, "BIDX", 4)!=0) die("bad block index magic, expected 'BIDX'");
+        const uint8_t* base = (const uint8_t*)mm.data;
+        if (d_off < size_t(adj-base) || d_off + uint64_t(cnt)*kRecord + kTrailer != mm.sz) die("corrupt block index");
+        if (loops_rel > d_off - size_t(adj-base)) die("corrupt block index (loops offset)");
+        BinReader br((const char*)base + d_off, size_t(cnt)*kRecord);
+        blocks.resize(cnt);
+        for (BlockSummary &b : blocks){
+            b.first = br.u32le(); b.offset = br.u64le(); b.edges = br.u64le();
+            if (wb == 2){ b.wmin = br.u16le(); b.wmax = br.u16le(); } else { b.wmin = br.get(); b.wmax = br.get(); }
+            b.nmin = br.u32le(); b.nmax = br.u32le();
+            if (b.offset > loops_rel || b.first >= N) die("corrupt block index (record)");
+        }
+        end = base + d_off;
+        loops = adj + loops_rel;
+        has_index = true;
+    }
+
+    BinReader section_b() const { return BinReader((const char*)adj, size_t(end-adj)); }
+    BinReader at_block(size_t b) const { return BinReader((const char*)adj + blocks[b].offset, size_t(end-adj) - blocks[b].offset); }
+};
+
+// Decodes Section C (self-loops) of an N-vertex graph, calling f(vertex, weight) in stored order.
+template<class Weight = WeightU8, class F>
+static void for_each_loop(BinReader &br, uint32_t N, F f){
+    if (br.p == br.e) return; // v2 empty-graph files end right after the header
+    uint64_t L = br.varu();
+    uint32_t acc = 0;
+    for (uint64_t t=0;t<L;++t){
+        uint64_t d = br.varu();
+        if (acc + d >= N) die("corrupt self-loop list (vertex out of range)");
+        uint32_t v = acc + (uint32_t)d;
+        auto w = Weight::get(br);
+        f(v, w);
+        acc = v;
+    }
+}
+
+// Reads the rows of g in order from the first row of block b: read(i, ...) for i = blocks[b].first,
+// first+1, ... With delta segments, row i is the base row of i (if any) merged by neighbor with
+// each segment's row of i, in segment order; equal neighbors keep that order, as in GraphMerge,
+// so the edges come out exactly as a compacted file's would.
+template<class Fmt>
+struct RowReader {
+    using W = typename Fmt::weight::type;
+    const GraphFile &g;
+    BinReader br;      // base Section B
+    uint32_t next = 0; // next base row
+    vector<BinReader> dbr; vector<uint32_t> dnext;
+    vector<uint32_t> tn, mn; vector<uint8_t> tw; vector<W> mw;
+
+    RowReader(const GraphFile &g, size_t b) : g(g), br(g.at_block(b)) {
+        if (g.deltas.empty()) return;
+        next = uint32_t(std::lower_bound(g.base_remap.begin(), g.base_remap.end(), g.blocks[b].first) - g.base_remap.begin());
+        for (const GraphFile::Delta &d : g.deltas){
+            dbr.emplace_back((const char*)d.g->adj + d.offset[b], size_t(d.g->end - d.g->adj) - d.offset[b]);
+            dnext.push_back(d.row[b]);
+        }
+    }
+
+    uint64_t read(uint32_t i, vector<uint32_t> &nei, vector<W> &w){
+        if (g.deltas.empty()) return read_row_t<Fmt>(br, g.N, i, nei, w);
+        uint64_t deg = 0;
+        if (next < g.base_N && g.base_remap[next] == i){
+            deg = read_row_t<Fmt>(br, g.base_N, next++, nei, w);
+            if (!g.base_identity) for (uint64_t k=0;k<deg;++k) nei[k] = g.base_remap[nei[k]];
+        }
+        for (size_t s=0;s<g.deltas.size();++s){
+            const GraphFile::Delta &d = g.deltas[s];
+            if (dnext[s] >= d.g->N || d.remap[dnext[s]] != i) continue;
+            const uint64_t dd = read_row(dbr[s], d.g->N, dnext[s]++, tn, tw, d.g->flags);
+            if (mn.size() < deg + dd){ mn.resize(deg + dd); mw.resize(deg + dd); }
+            uint64_t a = 0, c = 0, o = 0;
+            while (a < deg && c < dd){
+                const uint32_t v = d.remap[tn[c]];
+                if (v < nei[a]){ mn[o] = v; mw[o++] = tw[c++]; }
+                else { mn[o] = nei[a]; mw[o++] = w[a++]; }
+            }
+            for (; a<deg; ++a, ++o){ mn[o] = nei[a]; mw[o] = w[a]; }
+            for (; c<dd; ++c, ++o){ mn[o] = d.remap[tn[c]]; mw[o] = tw[c]; }
+            nei.swap(mn); w.swap(mw); deg = o;
+        }
+        return deg;
+    }
+};
+
+// Calls f(i, nei, w, deg) for every row of g in order, delta segments included.
+template<class F>
+static void for_each_graph_row(const GraphFile &g, F f){
+    with_row_format(g.flags, [&](auto fmt){
+        using W = typename decltype(fmt)::weight::type;
+        if (!g.N) return;
+        vector<uint32_t> nei; vector<W> w;
+        RowReader<decltype(fmt)> rows(g, 0);
+        for (uint32_t i=0;i<g.N;++i){
+            const uint64_t deg = rows.read(i, nei, w);
+            f(i, (const uint32_t*)nei.data(), (const W*)w.data(), deg);
+        }
+    });
+}
+
+// Calls f(v, w) for the self-loops of g in ascending vertex order, br being at Section C. With
+// delta segments the base loops and each segment's are merged by vertex, in that order on ties.
+template<class Weight, class F>
+static void for_each_graph_loop(const GraphFile &g, BinReader &br, F f){
+    if (g.deltas.empty()){ for_each_loop<Weight>(br, g.N, f); return; }
+    vector<pair<uint32_t, typename Weight::type>> acc;
+    for_each_loop<Weight>(br, g.base_N, [&](uint32_t x, auto w){ acc.emplace_back(g.base_remap[x], w); });
+    for (const GraphFile::Delta &d : g.deltas){
+        const size_t mid = acc.size();
+        BinReader dbr((const char*)d.g->loops, size_t(d.g->end - d.g->loops));
+        for_each_loop(dbr, d.g->N, [&](uint32_t x, uint8_t w){ acc.emplace_back(d.remap[x], w); });
+        std::inplace_merge(acc.begin(), acc.begin()+mid, acc.end(), [](auto &x, auto &y){ return x.first < y.first; });
+    }
+    for (auto &lw : acc) f(lw.first, lw.second);
+}
+
+// ========================= K-way merge of binary graphs =========================
+// Merges several graph files without going through TSV. The ascending Section A mappings are
+// k-way merged into one mapping plus a per-input local->merged id table; since that table is
+// monotonic, every input's rows arrive in merged order with ascending neighbors, so stream()
+// only has to merge the rows of inputs sharing a vertex. With `dedup`, identical (u, v, w)
+// edges and identical self-loops are kept once.
+// k-way merge of ascending newId->originalId mappings into their union `orig`; remap[k][i] is
+// the union id of maps[k][i].
+static void merge_mappings(const vector<const vector<uint32_t>*> &maps, vector<uint32_t> &orig, vector<vector<uint32_t>> &remap){
+    const size_t K = maps.size();
+    orig.clear(); remap.assign(K, {});
+    using Head = pair<uint32_t, size_t>; // (original id, input)
+    priority_queue<Head, vector<Head>, greater<Head>> pq;
+    vector<uint32_t> pos(K, 0);
+    for (size_t k=0;k<K;++k){ remap[k].resize(maps[k]->size()); if (!maps[k]->empty()) pq.push({(*maps[k])[0], k}); }
+    while (!pq.empty()){
+        Head h = pq.top(); pq.pop();
+        if (orig.empty() || orig.back()!=h.first) orig.push_back(h.first);
+        const size_t k = h.second;
+        remap[k][pos[k]] = uint32_t(orig.size()-1);
+        if (++pos[k] < maps[k]->size()) pq.push({(*maps[k])[pos[k]], k});
+    }
+}
+
+struct GraphMerge {
+    vector<unique_ptr<GraphFile>> in;
+    vector<uint32_t> orig;          // merged newId -> originalId
+    vector<vector<uint32_t>> remap; // per input: local newId -> merged newId
+    bool dedup = false;
+
+    GraphMerge(const vector<string> &paths, bool dedup_identical) : dedup(dedup_identical) {
+        for (const string &p : paths){
+            in.emplace_back(new GraphFile(p));
+            if (in.back()->flags & kFlagOriented) die("cannot merge, diff, patch or add deltas to a graph written with --orient: " + p);
+            if (in.back()->wide()) die("cannot merge, diff, patch or add deltas to a graph with 64-bit ids or 16-bit weights: " + p);
+            if (!in.back()->loops) in.back()->scan_index(); // v1/v2: locate Section C up front
+        }
+        vector<const vector<uint32_t>*> maps;
+        for (auto &g : in) maps.push_back(&g->orig_of);
+        merge_mappings(maps, orig, remap);
+    }
+
+    uint32_t N() const { return (uint32_t)orig.size(); }
+
+    // Total edge count of the merged graph (a counting pass when duplicates are dropped).
+    uint64_t edges() const {
+        uint64_t M = 0;
+        if (!dedup){ for (auto &g : in) M += g->M_total; return M; }
+        stream_rows([&](uint32_t, const uint32_t*, const uint8_t*, uint64_t deg){ M += deg; });
+        stream_loops([&](uint32_t, uint8_t){ ++M; });
+        return M;
+    }
+
+    // For every merged vertex v ascending: calls visit(k, v, nei, w, deg) for each input k holding a
+    // row for v (neighbors already in merged ids), then done(v).
+    template<class VisitF, class DoneF>
+    void for_each_input_row(VisitF visit, DoneF done) const {
+        const size_t K = in.size();
+        vector<BinReader> br; br.reserve(K);
+        for (auto &g : in) br.push_back(g->section_b());
+        vector<uint32_t> next(K, 0);
+        vector<uint32_t> tn; vector<uint8_t> tw;
+        const uint32_t N = this->N();
+        for (uint32_t v=0;v<N;++v){
+            for (size_t k=0;k<K;++k){
+                if (next[k] >= in[k]->N || remap[k][next[k]] != v) continue;
+                uint64_t deg = read_row(br[k], in[k]->N, next[k]++, tn, tw, in[k]->flags);
+                for (uint64_t t=0;t<deg;++t) tn[t] = remap[k][tn[t]];
+                visit(k, v, tn.data(), tw.data(), deg);
+            }
+            done(v);
+        }
+    }
+
+    // Calls loop(k, v, w) for the self-loops of every input k in turn (v in merged ids, ascending per input).
+    template<class LoopF>
+    void for_each_input_loop(LoopF loop) const {
+        for (size_t k=0;k<in.size();++k){
+            BinReader br((const char*)in[k]->loops, size_t(in[k]->end - in[k]->loops));
+            for_each_loop(br, in[k]->N, [&](uint32_t x, uint8_t w){ loop(k, remap[k][x], w); });
+        }
+    }
+
+    // Calls row(v, nei, w, deg) for every merged vertex v ascending.
+    template<class RowF>
+    void stream_rows(RowF row) const {
+        vector<pair<uint32_t,uint8_t>> acc;
+        vector<uint32_t> nei; vector<uint8_t> w;
+        for_each_input_row([&](size_t, uint32_t, const uint32_t* tn, const uint8_t* tw, uint64_t deg){
+            size_t mid = acc.size();
+            for (uint64_t t=0;t<deg;++t) acc.emplace_back(tn[t], tw[t]);
+            std::inplace_merge(acc.begin(), acc.begin()+mid, acc.end(), [](auto &x, auto &y){ return x.first < y.first; });
+        }, [&](uint32_t v){
+            if (dedup) drop_identical(acc);
+            nei.resize(acc.size()); w.resize(acc.size());
+            for (size_t t=0;t<acc.size();++t){ nei[t] = acc[t].first; w[t] = acc[t].second; }
+            row(v, nei.data(), w.data(), (uint64_t)acc.size());
+            acc.clear();
+        });
+    }
+
+    // Calls loop(v, w) for every merged self-loop in ascending vertex order.
+    template<class LoopF>
+    void stream_loops(LoopF loop) const {
+        vector<pair<uint32_t,uint8_t>> acc;
+        size_t cur_k = SIZE_MAX, mid = 0;
+        for_each_input_loop([&](size_t k, uint32_t v, uint8_t w){
+            if (k != cur_k){ std::inplace_merge(acc.begin(), acc.begin()+mid, acc.end(), [](auto &x, auto &y){ return x.first < y.first; }); mid = acc.size(); cur_k = k; }
+            acc.emplace_back(v, w);
+        });
+        std::inplace_merge(acc.begin(), acc.begin()+mid, acc.end(), [](auto &x, auto &y){ return x.first < y.first; });
+        if (dedup) drop_identical(acc);
+        for (auto &lw : acc) loop(lw.first, lw.second);
+    }
+
+    // Removes repeated (id, weight) pairs inside runs of equal ids of an id-sorted list.
+    static void drop_identical(vector<pair<uint32_t,uint8_t>> &a){
+        size_t out = 0;
+        for (size_t b=0;b<a.size();){
+            size_t e = b+1;
+            while (e<a.size() && a[e].first==a[b].first) ++e;
+            if (e-b > 1) std::sort(a.begin()+b, a.begin()+e);
+            for (size_t t=b;t<e;++t) if (t==b || a[t].second!=a[t-1].second) a[out++] = a[t];
+            b = e;
+        }
+        a.resize(out);
+    }
+
+    void write(const string &path) const { BinWriter bw(path); write(bw); }
+    void write(BinWriter &bw) const {
+        const uint64_t M = edges();
+        uint64_t L = 0;
+        stream_loops([&](uint32_t, uint8_t){ ++L; });
+        GraphWriter gw(bw);
+        gw.header(N(), M);
+        gw.mapping(orig.data(), N());
+        stream_rows([&](uint32_t v, const uint32_t* nei, const uint8_t* w, uint64_t deg){ gw.row(v, nei, w, deg); });
+        gw.loops_begin(L);
+        stream_loops([&](uint32_t v, uint8_t w){ gw.loop(v, w); });
+        gw.finish();
+    }
+};
+
+// ========================= Graph diff / patch =========================
+// `--diff old.bin new.bin -o patch.bin` merges both sorted mappings and streams both graphs' rows
+// side by side (GraphMerge), recording per vertex pair the removed and added edges, or a changed
+// weight when the pair has exactly one edge on each side. `--patch old.bin patch.bin -o new.bin`
+// streams old.bin with the edits applied; vertices left without edges drop out of the mapping.
+// Patch file (LE):
+//   [4B magic 'GPCH'][1B version=1][1B endian=1]
+//   [VarUInt K][u32 first_original_id][K-1 VarUInt deltas]  // the K vertices the patch touches
+//   three record lists: removed, added, changed; each [VarUInt count] then records sorted by (u, v):
+//       [VarUInt u - prev_u][VarUInt (u != prev_u) ? v - u : v - prev_v][weight 1B]
+//       (changed records carry [old weight 1B][new weight 1B])
+//   u <= v are indices into the patch mapping; u == v is a self-loop.
+struct PatchRec { uint32_t u, v; uint8_t w, w2; };
+static inline bool rec_less(const PatchRec &a, const PatchRec &b){ return a.u!=b.u ? a.u<b.u : a.v<b.v; }
+
+struct GraphPatch {
+    enum { kRemoved = 0, kAdded = 1, kChanged = 2 };
+    vector<uint32_t> orig;
+    vector<PatchRec> lists[3];
+
+    void write(const string &path) const {
+        BinWriter bw(path);
+        bw.write("GPCH",4); bw.put(1); bw.put(1);
+        bw.varu(orig.size());
+        MappingDelta32::write(bw, orig.data(), (uint32_t)orig.size());
+        for (int l=0;l<3;++l){
+            bw.varu(lists[l].size());
+            uint32_t pu = 0, pv = 0;
+            for (const PatchRec &r : lists[l]){
+                bw.varu(r.u - pu); bw.varu(r.u != pu ? r.v - r.u : r.v - pv);
+                bw.put(r.w); if (l==kChanged) bw.put(r.w2);
+                pu = r.u; pv = r.v;
+            }
+        }
+        bw.flush();
+    }
+
+    void read(const string &path){
+        MMap mm = MMap::map_file(path);
+        BinReader br(mm.data, mm.sz);
+        if (!br.has(6) || memcmp(br.p, "GPCH", 4)!=0) die("bad magic, expected 'GPCH': " + path);
+        br.p += 4;
+        if (br.get()!=1) die("unsupported patch version");
+        if (br.get()!=1) die("unsupported endianness (only little-endian=1)");
+        uint64_t K = br.varu();
+        if (K > size_t(br.e - br.p)) die("corrupt patch mapping");
+        orig.resize(K);
+        MappingDelta32::read(br, orig, (uint32_t)K);
+        for (int l=0;l<3;++l){
+            uint64_t n = br.varu();
+            if (n > size_t(br.e - br.p)) die("corrupt patch records");
+            lists[l].resize(n);
+            uint32_t pu = 0, pv = 0;
+            for (PatchRec &r : lists[l]){
+                uint32_t du = (uint32_t)br.varu(), dv = (uint32_t)br.varu();
+                r.u = pu + du; r.v = du ? r.u + dv : pv + dv;
+                r.w = br.get(); r.w2 = (l==kChanged) ? br.get() : 0;
+                if (r.v >= K || r.v < r.u) die("corrupt patch record");
+                pu = r.u; pv = r.v;
+            }
+        }
+    }
+};
+
+// Diffs two (key, weight) lists sorted by key; emit(kind, key, w, w2) for every difference.
+template<class EmitF>
+static void diff_sorted(vector<pair<uint32_t,uint8_t>> &a, vector<pair<uint32_t,uint8_t>> &b, EmitF emit){
+    size_t i=0, j=0;
+    vector<uint8_t> wa, wb, tmp;
+    while (i<a.size() || j<b.size()){
+        const uint32_t key = (j>=b.size() || (i<a.size() && a[i].first<=b[j].first)) ? a[i].first : b[j].first;
+        wa.clear(); wb.clear();
+        while (i<a.size() && a[i].first==key) wa.push_back(a[i++].second);
+        while (j<b.size() && b[j].first==key) wb.push_back(b[j++].second);
+        if (wa.size()==1 && wb.size()==1){ if (wa[0]!=wb[0]) emit(GraphPatch::kChanged, key, wa[0], wb[0]); continue; }
+        sort(wa.begin(), wa.end()); sort(wb.begin(), wb.end());
+        tmp.clear(); std::set_difference(wa.begin(), wa.end(), wb.begin(), wb.end(), back_inserter(tmp));
+        for (uint8_t w : tmp) emit(GraphPatch::kRemoved, key, w, 0);
+        tmp.clear(); std::set_difference(wb.begin(), wb.end(), wa.begin(), wa.end(), back_inserter(tmp));
+        for (uint8_t w : tmp) emit(GraphPatch::kAdded, key, w, 0);
+    }
+}
+
+static void diff_graphs(const string &old_path, const string &new_path, const string &out_path){
+    GraphMerge m({old_path, new_path}, false);
+    GraphPatch patch;
+    vector<PatchRec> rec[3]; // in merged ids
+    vector<pair<uint32_t,uint8_t>> side[2];
+    m.for_each_input_row([&](size_t k, uint32_t, const uint32_t* nei, const uint8_t* w, uint64_t deg){
+        for (uint64_t t=0;t<deg;++t) side[k].emplace_back(nei[t], w[t]);
+    }, [&](uint32_t u){
+        diff_sorted(side[0], side[1], [&](int kind, uint32_t v, uint8_t w, uint8_t w2){ rec[kind].push_back({u, v, w, w2}); });
+        side[0].clear(); side[1].clear();
+    });
+    m.for_each_input_loop([&](size_t k, uint32_t v, uint8_t w){ side[k].emplace_back(v, w); });
+    diff_sorted(side[0], side[1], [&](int kind, uint32_t v, uint8_t w, uint8_t w2){ rec[kind].push_back({v, v, w, w2}); });
+
+    // renumber over the touched vertices only
+    vector<uint32_t> used;
+    for (auto &l : rec) for (auto &r : l){ used.push_back(r.u); used.push_back(r.v); }
+    sort(used.begin(), used.end()); used.erase(unique(used.begin(), used.end()), used.end());
+    patch.orig.resize(used.size());
+    for (size_t x=0;x<used.size();++x) patch.orig[x] = m.orig[used[x]];
+    auto local = [&](uint32_t id){ return (uint32_t)(std::lower_bound(used.begin(), used.end(), id) - used.begin()); };
+    for (int l=0;l<3;++l){
+        for (auto &r : rec[l]){ r.u = local(r.u); r.v = local(r.v); }
+        std::stable_sort(rec[l].begin(), rec[l].end(), rec_less);
+        patch.lists[l] = std::move(rec[l]);
+    }
+    patch.write(out_path);
+    fprintf(stderr, "diff: removed=%zu added=%zu changed=%zu touched_vertices=%zu\n",
+            patch.lists[0].size(), patch.lists[1].size(), patch.lists[2].size(), patch.orig.size());
+}
+
+// old.bin with a patch applied, streamed in the union id space of both mappings.
+struct PatchedGraph {
+    GraphFile g;
+    GraphPatch patch;
+    vector<uint32_t> uorig;          // union newId -> originalId
+    vector<vector<uint32_t>> remap;  // [0]: old ids, [1]: patch ids -> union ids
+
+    PatchedGraph(const string &old_path, const string &patch_path) : g(old_path) {
+        if (g.flags & kFlagOriented) die("cannot merge, diff, patch or add deltas to a graph written with --orient: " + old_path);
+        if (g.wide()) die("cannot merge, diff, patch or add deltas to a graph with 64-bit ids or 16-bit weights: " + old_path);
+        if (!g.loops) g.scan_index();
+        patch.read(patch_path);
+        merge_mappings({&g.orig_of, &patch.orig}, uorig, remap);
+        for (auto &l : patch.lists) for (auto &r : l){ r.u = remap[1][r.u]; r.v = remap[1][r.v]; }
+    }
+
+    // Applies the edits keyed `u` (for rows: records with that u and v>u; for loops: u==v) to list,
+    // a (key, weight) list sorted by key; records are consumed through the cursors in `at`.
+    template<class Match>
+    static void apply(vector<pair<uint32_t,uint8_t>> &list, const vector<PatchRec>* lists, size_t* at, Match same_group){
+        auto find = [&](uint32_t key, uint8_t w) -> size_t {
+            auto it = std::lower_bound(list.begin(), list.end(), key, [](const pair<uint32_t,uint8_t> &x, uint32_t k){ return x.first < k; });
+            for (; it!=list.end() && it->first==key; ++it) if (it->second==w) return size_t(it - list.begin());
+            die("patch does not apply: edge missing from the base graph");
+        };
+        for (; at[GraphPatch::kRemoved] < lists[GraphPatch::kRemoved].size() && same_group(lists[GraphPatch::kRemoved][at[GraphPatch::kRemoved]]); ++at[GraphPatch::kRemoved]){
+            const PatchRec &r = lists[GraphPatch::kRemoved][at[GraphPatch::kRemoved]];
+            list.erase(list.begin() + find(r.v, r.w));
+        }
+        for (; at[GraphPatch::kChanged] < lists[GraphPatch::kChanged].size() && same_group(lists[GraphPatch::kChanged][at[GraphPatch::kChanged]]); ++at[GraphPatch::kChanged]){
+            const PatchRec &r = lists[GraphPatch::kChanged][at[GraphPatch::kChanged]];
+            list[find(r.v, r.w)].second = r.w2;
+        }
+        size_t mid = list.size();
+        for (; at[GraphPatch::kAdded] < lists[GraphPatch::kAdded].size() && same_group(lists[GraphPatch::kAdded][at[GraphPatch::kAdded]]); ++at[GraphPatch::kAdded]){
+            const PatchRec &r = lists[GraphPatch::kAdded][at[GraphPatch::kAdded]];
+            list.emplace_back(r.v, r.w);
+        }
+        std::inplace_merge(list.begin(), list.begin()+mid, list.end(), [](auto &x, auto &y){ return x.first < y.first; });
+    }
+
+    // row(u, list) for every union vertex u ascending, with `list` the patched upper row.
+    template<class RowF>
+    void stream_rows(RowF row) const {
+        vector<PatchRec> edits[3]; // non-loop records, in (u, v) order
+        for (int l=0;l<3;++l){ for (auto &r : patch.lists[l]) if (r.u!=r.v) edits[l].push_back(r); std::stable_sort(edits[l].begin(), edits[l].end(), rec_less); }
+        size_t at[3] = {0,0,0};
+        BinReader br = g.section_b();
+        vector<uint32_t> nei; vector<uint8_t> wts;
+        vector<pair<uint32_t,uint8_t>> list;
+        uint32_t next = 0;
+        for (uint32_t u=0;u<(uint32_t)uorig.size();++u){
+            list.clear();
+            if (next < g.N && remap[0][next]==u){
+                uint64_t deg = read_row(br, g.N, next++, nei, wts, g.flags);
+                for (uint64_t t=0;t<deg;++t) list.emplace_back(remap[0][nei[t]], wts[t]);
+            }
+            apply(list, edits, at, [&](const PatchRec &r){ return r.u==u; });
+            row(u, list);
+        }
+    }
+
+    // Patched self-loops as a (vertex, weight) list sorted by vertex.
+    vector<pair<uint32_t,uint8_t>> loops() const {
+        vector<pair<uint32_t,uint8_t>> list;
+        BinReader br((const char*)g.loops, size_t(g.end - g.loops));
+        for_each_loop(br, g.N, [&](uint32_t v, uint8_t w){ list.emplace_back(remap[0][v], w); });
+        vector<PatchRec> edits[3];
+        for (int l=0;l<3;++l) for (auto &r : patch.lists[l]) if (r.u==r.v) edits[l].push_back(r);
+        size_t at[3] = {0,0,0};
+        apply(list, edits, at, [](const PatchRec&){ return true; });
+        return list;
+    }
+
+    void write(const string &path) const {
+        // pass 1: which union vertices keep an edge, and the new edge count
+        const uint32_t U = (uint32_t)uorig.size();
+        vector<uint8_t> alive(U, 0);
+        uint64_t M = 0;
+        stream_rows([&](uint32_t u, const vector<pair<uint32_t,uint8_t>> &list){
+            if (!list.empty()) alive[u] = 1;
+            for (auto &e : list) alive[e.first] = 1;
+            M += list.size();
+        });
+        vector<pair<uint32_t,uint8_t>> lp = loops();
+        for (auto &e : lp) alive[e.first] = 1;
+        M += lp.size();
+        vector<uint32_t> id(U, 0), orig;
+        for (uint32_t u=0;u<U;++u) if (alive[u]){ id[u] = (uint32_t)orig.size(); orig.push_back(uorig[u]); }
+
+        // pass 2: encode
+        BinWriter bw(path);
+        GraphWriter gw(bw);
+        gw.header((uint32_t)orig.size(), M);
+        gw.mapping(orig.data(), (uint32_t)orig.size());
+        vector<uint32_t> nei; vector<uint8_t> w;
+        stream_rows([&](uint32_t u, const vector<pair<uint32_t,uint8_t>> &list){
+            if (!alive[u]) return;
+            nei.resize(list.size()); w.resize(list.size());
+            for (size_t t=0;t<list.size();++t){ nei[t] = id[list[t].first]; w[t] = list[t].second; }
+            gw.row(id[u], nei.data(), w.data(), list.size());
+        });
+        gw.loops_begin(lp.size());
+        for (auto &e : lp) gw.loop(id[e.first], e.second);
+        gw.finish();
+    }
+};
+
+// ========================= Delta segments =========================
+// `--append` serializes a batch of new edges into the next free `<base>.delta-NNNN` (NNNN = 0001,
+// 0002, ...): an ordinary v3 file with its own local mapping. Readers open graphs through
+// open_graph(), which keeps the base and every delta mapped and merges them on read (no dedup:
+// appended edges add to the multiset like concatenated TSV). Only Section A is merged up front,
+// plus one walk over each delta's rows to place them in the base's blocks; the base rows are
+// decoded where they lie and the delta rows merged in per row. `--compact` folds the deltas into
+// a single v3 base file and removes them, like an LSM-tree compaction; it runs when invoked,
+// not in the background, and readers never wait for it.
+
+static string delta_path(const string &base, unsigned n){
+    char suf[24]; snprintf(suf, sizeof(suf), ".delta-%04u", n);
+    return base + suf;
+}
+
+static vector<string> delta_segments(const string &base){
+    vector<string> out;
+    for (unsigned n=1;;++n){ string p = delta_path(base, n); if (!file_exists(p)) break; out.push_back(p); }
+    return out;
+}
+
+// Opens base with its delta segments. The merged blocks are the base blocks, each widened to the
+// merged ids up to the next base block, with the delta rows in that range added to its summary.
+static unique_ptr<GraphFile> open_graph(const string &path){
+    unique_ptr<GraphFile> g(new GraphFile(path));
+    const vector<string> parts = delta_segments(path);
+    if (parts.empty()) return g;
+    auto check = [](const GraphFile &f, const string &p){
+        if (f.flags & kFlagOriented) die("cannot merge, diff, patch or add deltas to a graph written with --orient: " + p);
+        if (f.wide()) die("cannot merge, diff, patch or add deltas to a graph with 64-bit ids or 16-bit weights: " + p);
+    };
+    check(*g, path);
+    if (!g->loops) g->scan_index();
+    vector<const vector<uint32_t>*> maps{&g->orig_of};
+    for (const string &p : parts){
+        g->deltas.emplace_back();
+        g->deltas.back().g.reset(new GraphFile(p));
+        check(*g->deltas.back().g, p);
+        maps.push_back(&g->deltas.back().g->orig_of);
+    }
+    vector<uint32_t> orig; vector<vector<uint32_t>> remap;
+    merge_mappings(maps, orig, remap);
+    g->base_N = g->N;
+    g->base_remap = std::move(remap[0]);
+    g->base_identity = !g->base_N || g->base_remap[g->base_N-1] == g->base_N-1;
+    g->N = uint32_t(orig.size());
+    g->orig_of = std::move(orig);
+
+    vector<BlockSummary> &bl = g->blocks;
+    if (bl.empty()) bl.emplace_back();
+    for (size_t b=0;b<bl.size();++b){
+        BlockSummary &s = bl[b];
+        if (s.nmin <= s.nmax){
+            if (s.nmax >= g->base_N) die("corrupt block index (record)");
+            s.nmin = g->base_remap[s.nmin]; s.nmax = g->base_remap[s.nmax];
+        }
+        s.first = b ? g->base_remap[s.first] : 0;
+        if (b && s.first <= bl[b-1].first) die("corrupt block index (record)");
+    }
+    vector<uint32_t> nei; vector<uint8_t> w;
+    for (size_t k=0;k<g->deltas.size();++k){
+        GraphFile::Delta &d = g->deltas[k];
+        GraphFile &f = *d.g;
+        d.remap = std::move(remap[k+1]);
+        d.row.resize(bl.size()); d.offset.resize(bl.size());
+        g->M_total += f.M_total;
+        BinReader br = f.section_b();
+        for (uint32_t j=0, b=0;;++j){
+            for (; b < bl.size() && (j == f.N || d.remap[j] >= bl[b].first); ++b){ d.row[b] = j; d.offset[b] = uint64_t(br.p - f.adj); }
+            if (j == f.N) break;
+            const uint64_t deg = read_row(br, f.N, j, nei, w, f.flags);
+            BlockSummary &s = bl[b-1]; // bl[0].first == 0
+            s.edges += deg;
+            for (uint64_t t=0;t<deg;++t){
+                s.wmin = min<uint16_t>(s.wmin, w[t]); s.wmax = max<uint16_t>(s.wmax, w[t]);
+                s.nmin = min(s.nmin, d.remap[nei[t]]); s.nmax = max(s.nmax, d.remap[nei[t]]);
+            }
+        }
+        if (!f.loops) f.loops = br.p;
+    }
+    return g;
+}
+
+// Rewrites base as base+deltas, then drops the deltas. Readers running concurrently with the
+// final rename/unlink steps may briefly see the deltas twice.
+static void compact_graph(const string &base){
+    vector<string> parts = delta_segments(base);
+    if (parts.empty()) return;
+    parts.insert(parts.begin(), base);
+    const string tmp = base + ".compact.tmp";
+    {
+        BinWriter bw(tmp);
+        GraphMerge(parts, false).write(bw);
+        if (::fsync(bw.fd) != 0) die("fsync failed: " + tmp);
+    }
+    if (::rename(tmp.c_str(), base.c_str()) != 0) die("cannot replace " + base);
+    for (size_t k=parts.size()-1;k>=1;--k) if (::unlink(parts[k].c_str()) != 0) die("cannot remove " + parts[k]);
+}
+
+// ========================= Decode filters =========================
+// Edge predicate evaluated inside the Section B decode loop (-d --min-weight/--max-weight/--vertices):
+// an edge is kept if its weight is in [wmin, wmax] and, with a vertex set, one endpoint is in the set.
+struct EdgeFilter {
+    unsigned wmin = 0, wmax = 0xFFFF;
+    string vertices_path;   // original ids separated by whitespace
+    vector<uint64_t> vbits; // membership by new id, filled by bind()
+    vector<uint32_t> vids;  // the same set as sorted new ids, for block pruning
+    string range_spec;      // --range / --orig-range "a:b": keep edges whose source row is in [a, b)
+    bool range_orig = false;
+    uint32_t lo = 0, hi = 0xFFFFFFFFu; // resolved source range in new ids
+
+    bool active() const { return wmin>0 || wmax<0xFFFF || !vertices_path.empty() || !range_spec.empty(); }
+    bool by_vertex() const { return !vertices_path.empty(); }
+    inline bool keep_w(unsigned w) const { return w>=wmin && w<=wmax; }
+    inline bool in_set(uint32_t v) const { return (vbits[v>>6] >> (v&63)) & 1; }
+    inline bool in_range(uint32_t v) const { return v>=lo && v<hi; }
+
+    // Loads the vertex file and translates original ids to new ids of g; unknown ids are ignored.
+    void bind(const GraphFile &g){
+        if (wmin > wmax) die("--min-weight is greater than --max-weight");
+        if (!range_spec.empty()) bind_range(g);
+        if (!by_vertex()) return;
+        vbits.assign((g.N+63)/64, 0);
+        MMap mm = MMap::map_file(vertices_path);
+        const char* q = mm.data; const char* e = mm.data + mm.sz;
+        while (q<e){
+            if (*q==' ' || *q=='\t' || *q=='\n' || *q=='\r'){ ++q; continue; }
+            uint64_t x = 0;
+            while (q<e && *q>='0' && *q<='9'){
+                if (__builtin_mul_overflow(x, 10u, &x) || __builtin_add_overflow(x, unsigned(*q - '0'), &x)) die("vertex id out of uint64 range in "+vertices_path);
+                ++q;
             }
+            if (q<e && !(*q==' ' || *q=='\t' || *q=='\n' || *q=='\r')) die("parse error in vertex file: "+vertices_path);
+            const uint32_t v = g.lower_orig(x);
+            if (v<g.N && g.orig(v)==x){ vbits[v>>6] |= uint64_t(1) << (v&63); vids.push_back(v); }
         }
+        sort(vids.begin(), vids.end()); vids.erase(unique(vids.begin(), vids.end()), vids.end());
+    }
+
+    // "a:b" (b may be omitted = to the end); original-id bounds map to a new-id range because
+    // new ids are assigned in ascending original-id order.
+    void bind_range(const GraphFile &g){
+        size_t colon = range_spec.find(':');
+        if (colon == string::npos) die("range must be a:b, got: " + range_spec);
+        uint64_t a = parse_num_arg(range_spec.substr(0, colon), "range start");
+        string bs = range_spec.substr(colon+1);
+        uint64_t b = bs.empty() ? UINT64_MAX : parse_num_arg(bs, "range end");
+        if (a > b) die("range start is greater than range end: " + range_spec);
+        if (range_orig){ lo = g.lower_orig(a); hi = bs.empty() ? g.N : g.lower_orig(b); }
+        else { lo = (uint32_t)min<uint64_t>(a, g.N); hi = (uint32_t)min<uint64_t>(b, g.N); }
+    }
+
+    bool any_in(uint32_t lo, uint32_t hi) const {
+        auto it = std::lower_bound(vids.begin(), vids.end(), lo);
+        return it!=vids.end() && *it<=hi;
+    }
+
+    // False if the block summary proves that no edge of rows [b.first, last] passes the filter.
+    bool may_match(const BlockSummary &b, uint32_t last) const {
+        if (b.edges==0 || b.wmax<wmin || b.wmin>wmax) return false;
+        if (last < lo || b.first >= hi) return false;
+        if (by_vertex() && !any_in(b.first, last) && !any_in(b.nmin, b.nmax)) return false;
+        return true;
+    }
+};
+
+// ========================= Core: deserialize =========================
+struct Deserializer {
+    string in_path, out_path;
+    EdgeFilter filter;
+    unsigned shards = 0;        // --shards P: out_path is a directory receiving P TSV files
+    bool shard_by_hash = false; // --shard-by hash|range (default range)
 
+    void run(){
+        unique_ptr<GraphFile> gp = open_graph(in_path); // base + delta segments
+        GraphFile &g = *gp;
+        filter.bind(g);
+        if ((filter.active() || shards) && !g.loops) g.scan_index();
+        if (shards){ run_sharded(g); return; }
         // output TSV
         TextWriter tw(out_path);
+        auto all = [](uint32_t){ return true; };
+        if (filter.active()) decode<true>(g, tw, 0, g.blocks.size(), all); else decode<false>(g, tw, 0, g.blocks.size(), all);
+        tw.flush();
+    }
 
-        // adjacency
-        for (uint32_t i=0;i<N;++i){
-            uint64_t deg = br.varu();
-            uint32_t prev = i;
-            for (uint64_t k=0;k<deg;++k){
-                uint64_t gap = br.varu();
-                uint32_t j = prev + (uint32_t)gap;
-                uint8_t w = br.get();
-                // print line: orig[i] \t orig[j] \t w\n
-                tw.putu(orig_of[i]); tw.put('\t');
-                tw.putu(orig_of[j]); tw.put('\t');
-                tw.putu8(w); tw.newline();
-                prev = j;
+    // One thread per shard. range: contiguous block runs with balanced edge counts, so each thread
+    // decodes only its own part of Section B; hash: rows (and loops) go to shard fmix64(orig) % P,
+    // each thread walks Section B and formats only the rows it owns.
+    void run_sharded(const GraphFile &g){
+        if (::mkdir(out_path.c_str(), 0755) != 0 && errno != EEXIST) die("cannot create output directory: " + out_path);
+        const size_t nb = g.blocks.size();
+        vector<size_t> cut(shards+1, nb); cut[0] = 0;
+        if (!shard_by_hash){
+            vector<uint64_t> pre(nb+1, 0);
+            for (size_t b=0;b<nb;++b) pre[b+1] = pre[b] + g.blocks[b].edges;
+            for (unsigned p=1;p<shards;++p){
+                uint64_t target = (uint64_t)((__uint128_t)pre[nb] * p / shards);
+                cut[p] = size_t(std::lower_bound(pre.begin()+cut[p-1], pre.end(), target) - pre.begin());
+                if (cut[p] > nb) cut[p] = nb;
             }
         }
+        auto shard_path = [&](unsigned p){
+            char name[32]; snprintf(name, sizeof(name), "part-%05u.tsv", p);
+            return out_path + (out_path.back()=='/' ? "" : "/") + name;
+        };
+        auto work = [&](unsigned p){
+            TextWriter tw(shard_path(p));
+            if (shard_by_hash){
+                auto owns = [&](uint32_t v){ return fmix64(g.orig(v)) % shards == p; };
+                if (filter.active()) decode<true>(g, tw, 0, nb, owns); else decode<false>(g, tw, 0, nb, owns);
+            } else {
+                const uint32_t lo = cut[p] < nb ? g.blocks[cut[p]].first : g.N;
+                const uint32_t hi = cut[p+1] < nb ? g.blocks[cut[p+1]].first : g.N;
+                auto owns = [&](uint32_t v){ return v>=lo && v<hi; };
+                if (filter.active()) decode<true>(g, tw, cut[p], cut[p+1], owns); else decode<false>(g, tw, cut[p], cut[p+1], owns);
+            }
+            tw.flush();
+        };
+        // shard threads inherit t_die_throws; in a --batch/--serve job the first failure is rethrown here
+        const bool throws = t_die_throws;
+        std::exception_ptr err;
+        std::mutex em;
+        vector<thread> pool;
+        for (unsigned p=0;p<shards;++p) pool.emplace_back([&, p]{
+            t_die_throws = throws;
+            try { work(p); }
+            catch (...) { std::lock_guard<std::mutex> lk(em); if (!err) err = std::current_exception(); }
+        });
+        for (auto &th : pool) th.join();
+        if (err) std::rethrow_exception(err);
+    }
+
+    // Writes the edges of blocks [b0, b1) whose source row satisfies owns(i), then the loops
+    // whose vertex does; the row loop is instantiated for the file's RowFormat and original-id type.
+    template<bool kFiltered, class Owns>
+    void decode(const GraphFile &g, TextWriter &tw, size_t b0, size_t b1, Owns owns) const {
+        with_row_format(g.flags, [&](auto fmt){
+            if (g.flags & kFlagWideIds) decode_as<kFiltered, decltype(fmt), uint64_t>(g, tw, b0, b1, owns);
+            else decode_as<kFiltered, decltype(fmt), uint32_t>(g, tw, b0, b1, owns);
+        });
+    }
+    template<bool kFiltered, class Fmt, class Id, class Owns>
+    void decode_as(const GraphFile &g, TextWriter &tw, size_t b0, size_t b1, Owns owns) const {
+        const vector<Id> &orig_of = g.mapping<Id>();
+        BinReader br = g.section_b();
+
+        // adjacency, block by block; with a filter, blocks whose summary excludes it are not decoded
+        vector<uint32_t> nei; vector<typename Fmt::weight::type> wts;
+        for (size_t b=b0;b<b1;++b){
+            const uint32_t first = g.blocks[b].first, last = g.block_end(b);
+            if (kFiltered && !filter.may_match(g.blocks[b], last-1)) continue;
+            RowReader<Fmt> rows(g, b);
+            for (uint32_t i=first;i<last;++i){
+                uint64_t deg = rows.read(i, nei, wts);
+                if (!owns(i)) continue;
+                if (kFiltered && !filter.in_range(i)){ if (i >= filter.hi) break; continue; }
+                const bool src_in = kFiltered && filter.by_vertex() && filter.in_set(i);
+                for (uint64_t k=0;k<deg;++k){
+                    if (kFiltered){
+                        if (!filter.keep_w(wts[k])) continue;
+                        if (filter.by_vertex() && !src_in && !filter.in_set(nei[k])) continue;
+                    }
+                    // print line: orig[i] \t orig[j] \t w\n
+                    tw.putu(orig_of[i]); tw.put('\t');
+                    tw.putu(orig_of[nei[k]]); tw.put('\t');
+                    tw.putw(wts[k]); tw.newline();
+                }
+            }
+            br = rows.br;
+        }
 
         // loops
-        uint64_t L = br.varu();
-        uint32_t acc = 0;
-        for (uint64_t t=0;t<L;++t){
-            uint64_t d = br.varu();
-            uint32_t v = acc + (uint32_t)d;
-            uint8_t w = br.get();
+        if (g.loops) br = BinReader((const char*)g.loops, size_t(g.end - g.loops));
+        for_each_graph_loop<typename Fmt::weight>(g, br, [&](uint32_t v, auto w){
+            if (!owns(v)) return;
+            if (kFiltered && (!filter.keep_w(w) || !filter.in_range(v) || (filter.by_vertex() && !filter.in_set(v)))) return;
             tw.putu(orig_of[v]); tw.put('\t');
             tw.putu(orig_of[v]); tw.put('\t');
-            tw.putu8(w); tw.newline();
-            acc = v;
+            tw.putw(w); tw.newline();
+        });
+    }
+};
+
+// ========================= Batched graph queries =========================
+// Neighbor lookups (all edges at v) and edge lookups (the copies of u-v) on one graph, in new ids,
+// answered together. The batch is sorted by vertex and turned into one task per block that any
+// lookup needs, so each needed block is decoded once per batch however many lookups touch it:
+//  - the row of a looked-up vertex (its upper neighbors, or for --orient files those it stores),
+//    and for an edge the row it is stored in (u<v: row u; --orient: rows u and v);
+//  - the rows listing a looked-up vertex v: only blocks whose neighbor range covers v (for upper
+//    files those starting at or before v), each row intersected with the sorted looked-up vertices;
+//  - Section C for self-loops, as one more task.
+// Tasks run on a ThreadPool; the hits are then sorted into per-query answers.
+struct QueryBatch {
+    struct Query { uint32_t u, v; bool edge; }; // ids >= N (not in the graph) get empty answers
+    vector<Query> q;
+    vector<pair<uint32_t, uint16_t>> hits; // answers of query k: hits[at[k] .. at[k+1]), ascending
+    vector<size_t> at;
+
+    void run(const GraphFile &g, ThreadPool &pool){
+        constexpr uint32_t kRow = 0xFFFFFFFFu;
+        struct Ask { uint32_t row, target, key; };       // target kRow: the whole row
+        struct Hit { uint32_t key, nb; uint16_t w; bool operator<(const Hit &o) const { return key != o.key ? key < o.key : nb != o.nb ? nb < o.nb : w < o.w; } };
+        struct Task { size_t b, a0, a1, s0, s1; uint32_t last; };
+        const bool oriented = g.flags & kFlagOriented;
+
+        // keys: [0, S) the distinct neighbor-lookup vertices verts[] (ascending), S+k edge query k
+        vector<uint32_t> verts;
+        auto known = [&](const Query &x){ return x.u < g.N && (!x.edge || x.v < g.N); };
+        for (const Query &x : q) if (!x.edge && known(x)) verts.push_back(x.u);
+        std::sort(verts.begin(), verts.end());
+        verts.erase(std::unique(verts.begin(), verts.end()), verts.end());
+        const uint32_t S = uint32_t(verts.size());
+        vector<Ask> asks;
+        vector<pair<uint32_t, uint32_t>> loop_asks; // (vertex, key) for loops; verts are looked up directly
+        for (uint32_t s=0;s<S;++s) asks.push_back({verts[s], kRow, s});
+        for (uint32_t k=0;k<q.size();++k){
+            const Query &x = q[k];
+            if (!x.edge || !known(x)) continue;
+            if (x.u == x.v) loop_asks.push_back({x.u, S+k});
+            else if (!oriented) asks.push_back({min(x.u, x.v), max(x.u, x.v), S+k});
+            else { asks.push_back({x.u, x.v, S+k}); asks.push_back({x.v, x.u, S+k}); }
+        }
+        std::sort(asks.begin(), asks.end(), [](const Ask &a, const Ask &b){ return a.row < b.row; });
+        std::sort(loop_asks.begin(), loop_asks.end());
+
+        vector<Task> tasks;
+        for (size_t b=0, a=0; b<g.blocks.size(); ++b){
+            const BlockSummary &bs = g.blocks[b];
+            const uint32_t end = g.block_end(b);
+            Task t{b, a, a, 0, 0, 0};
+            while (a < asks.size() && asks[a].row < end) ++a;
+            t.a1 = a;
+            if (bs.nmin <= bs.nmax){
+                t.s0 = size_t(std::lower_bound(verts.begin(), verts.end(), oriented ? bs.nmin : max(bs.nmin, bs.first+1)) - verts.begin());
+                t.s1 = max(t.s0, size_t(std::upper_bound(verts.begin(), verts.end(), bs.nmax) - verts.begin()));
+            }
+            if (t.a0 == t.a1 && t.s0 == t.s1) continue;
+            if (t.a1 > t.a0) t.last = asks[t.a1-1].row + 1;
+            if (t.s1 > t.s0) t.last = oriented ? end : max(t.last, min(end, verts[t.s1-1])); // upper rows list v only below v
+            tasks.push_back(t);
+        }
+        const bool loops = S || !loop_asks.empty();
+
+        vector<vector<Hit>> out(pool.size() + 1);
+        const std::function<void(size_t, unsigned)> work = [&](size_t ti, unsigned slot){
+            vector<Hit> &o = out[slot];
+            if (ti == tasks.size()){
+                BinReader br((const char*)g.loops, size_t(g.end - g.loops));
+                with_row_format(g.flags, [&](auto fmt){
+                    for_each_graph_loop<typename decltype(fmt)::weight>(g, br, [&](uint32_t x, auto w){
+                        auto s = std::lower_bound(verts.begin(), verts.end(), x);
+                        if (s != verts.end() && *s == x) o.push_back({uint32_t(s - verts.begin()), x, uint16_t(w)});
+                        for (auto l = std::lower_bound(loop_asks.begin(), loop_asks.end(), make_pair(x, 0u)); l != loop_asks.end() && l->first == x; ++l)
+                            o.push_back({l->second, x, uint16_t(w)});
+                    });
+                });
+                return;
+            }
+            const Task &t = tasks[ti];
+            const uint32_t* sv = verts.data() + t.s0;
+            const size_t ns = t.s1 - t.s0;
+            with_row_format(g.flags, [&](auto fmt){
+                using Fmt = decltype(fmt);
+                vector<uint32_t> nei; vector<typename Fmt::weight::type> w;
+                RowReader<Fmt> rows(g, t.b);
+                size_t a = t.a0;
+                for (uint32_t i=g.blocks[t.b].first;i<t.last;++i){
+                    const uint64_t deg = rows.read(i, nei, w);
+                    const uint32_t* nb = nei.data();
+                    for (; a < t.a1 && asks[a].row == i; ++a){
+                        const Ask &x = asks[a];
+                        if (x.target == kRow){ for (uint64_t k=0;k<deg;++k) o.push_back({x.key, nb[k], w[k]}); continue; }
+                        for (const uint32_t* p = std::lower_bound(nb, nb+deg, x.target); p != nb+deg && *p == x.target; ++p)
+                            o.push_back({x.key, x.target, w[p-nb]});
+                    }
+                    // rows listing looked-up vertices: merge, skipping ahead by binary search in the longer side
+                    for (size_t k=0, j=0; k<deg && j<ns;){
+                        if (nb[k] < sv[j]) k = ns*8 < deg ? size_t(std::lower_bound(nb+k, nb+deg, sv[j]) - nb) : k+1;
+                        else if (nb[k] > sv[j]) j = deg*8 < ns ? size_t(std::lower_bound(sv+j, sv+ns, nb[k]) - sv) : j+1;
+                        else { o.push_back({uint32_t(t.s0 + j), i, w[k]}); ++k; }
+                    }
+                }
+            });
+        };
+        pool.run(tasks.size() + loops, work);
+
+        vector<Hit> all;
+        for (auto &o : out) all.insert(all.end(), o.begin(), o.end());
+        std::sort(all.begin(), all.end());
+        // per-key ranges, then per-query answers in query order
+        const size_t keys = S + q.size();
+        vector<size_t> kat(keys + 1, 0);
+        for (const Hit &h : all) ++kat[h.key + 1];
+        for (size_t k=0;k<keys;++k) kat[k+1] += kat[k];
+        hits.clear(); at.assign(1, 0);
+        for (uint32_t k=0;k<q.size();++k){
+            const size_t key = q[k].edge ? S + k : size_t(std::lower_bound(verts.begin(), verts.end(), q[k].u) - verts.begin());
+            if (known(q[k])) for (size_t h=kat[key];h<kat[key+1];++h) hits.emplace_back(all[h].nb, all[h].w);
+            at.push_back(hits.size());
         }
-        tw.flush();
     }
 };
 
-// ========================= CLI =========================
-bool file_exists(const string &p){ struct stat st{}; return ::stat(p.c_str(), &st)==0; }
+// ========================= Analytics: triangle counting =========================
+// Counts each triangle i<j<k once as k in N+(i) ∩ N+(j) for j in N+(i), where N+ is the
+// Section B upper adjacency (for --orient files the degeneracy orientation, also acyclic).
+// Rows are decoded once into a neighbor-only CSR (weights and duplicate multi-edges dropped)
+// because the intersections need random access to N+(j).
 
-int main(int argc, char** argv){
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+// |a ∩ b| for strictly ascending arrays, na <= nb: binary search of a in b when skewed, else a
+// merge. The SIMD variants first compare blocks of a against every rotation of the same-size block
+// of b and advance whichever block ends lower (both on a tie), then finish with the scalar merge.
+static inline uint64_t intersect_skewed(const uint32_t* a, size_t na, const uint32_t* b, size_t nb){
+    uint64_t cnt = 0;
+    const uint32_t* lo = b; const uint32_t* be = b+nb;
+    for (size_t i=0;i<na && lo<be;++i){ lo = std::lower_bound(lo, be, a[i]); if (lo<be && *lo==a[i]) { ++cnt; ++lo; } }
+    return cnt;
+}
+static inline uint64_t intersect_merge(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, size_t i, size_t j, uint64_t cnt){
+    while (i<na && j<nb){
+        if (a[i]<b[j]) ++i; else if (a[i]>b[j]) ++j; else { ++cnt; ++i; ++j; }
+    }
+    return cnt;
+}
+static uint64_t intersect_scalar(const uint32_t* a, size_t na, const uint32_t* b, size_t nb){
+    if (na > nb){ swap(a,b); swap(na,nb); }
+    if (na*32 < nb) return intersect_skewed(a, na, b, nb);
+    return intersect_merge(a, na, b, nb, 0, 0, 0);
+}
+#if GRAPH_X86
+TARGET("avx2") static uint64_t intersect_avx2(const uint32_t* a, size_t na, const uint32_t* b, size_t nb){
+    if (na > nb){ swap(a,b); swap(na,nb); }
+    if (na*32 < nb) return intersect_skewed(a, na, b, nb);
+    uint64_t cnt = 0; size_t i=0, j=0;
+    const __m256i rot = _mm256_setr_epi32(1,2,3,4,5,6,7,0);
+    while (i+8<=na && j+8<=nb){
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b+j));
+        __m256i m = _mm256_cmpeq_epi32(va, vb);
+        for (int r=1;r<8;++r){ vb = _mm256_permutevar8x32_epi32(vb, rot); m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb)); }
+        cnt += (uint64_t)__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+        uint32_t amax = a[i+7], bmax = b[j+7];
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    return intersect_merge(a, na, b, nb, i, j, cnt);
+}
+#endif
+#if defined(__SSE2__)
+static uint64_t intersect_sse2(const uint32_t* a, size_t na, const uint32_t* b, size_t nb){
+    if (na > nb){ swap(a,b); swap(na,nb); }
+    if (na*32 < nb) return intersect_skewed(a, na, b, nb);
+    uint64_t cnt = 0; size_t i=0, j=0;
+    while (i+4<=na && j+4<=nb){
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+        __m128i m0 = _mm_cmpeq_epi32(va, vb);
+        __m128i m1 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1)));
+        __m128i m2 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2)));
+        __m128i m3 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3)));
+        __m128i m = _mm_or_si128(_mm_or_si128(m0,m1), _mm_or_si128(m2,m3));
+        cnt += (uint64_t)__builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+        uint32_t amax = a[i+3], bmax = b[j+3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+    return intersect_merge(a, na, b, nb, i, j, cnt);
+}
+#endif
+
+struct TriangleCounter {
+    string in_path;
+    void run(){
+        unique_ptr<GraphFile> gp = open_graph(in_path); // base + delta segments
+        GraphFile &g = *gp;
+        const uint32_t N = g.N;
+        const bool oriented = g.flags & kFlagOriented;
+
+        // Upper CSR without weights; multi-edges collapse to one neighbor
+        vector<uint64_t> off(N+1, 0);
+        vector<uint32_t> adj; adj.reserve(g.M_total);
+        for_each_graph_row(g, [&](uint32_t i, const uint32_t* nei, const auto*, uint64_t deg){
+            for (uint64_t k=0;k<deg;++k) if (k==0 || nei[k]!=nei[k-1]) adj.push_back(nei[k]);
+            off[i+1] = adj.size();
+        });
+
+        atomic<uint64_t> total{0};
+        const auto intersect = g_kernels.intersect;
+        parallel_for(N, 256, [&](uint64_t b, uint64_t e){
+            uint64_t local = 0;
+            for (uint64_t u=b;u<e;++u){
+                const uint32_t* nu = adj.data() + off[u];
+                size_t du = (size_t)(off[u+1]-off[u]);
+                for (size_t k=0;k<du;++k){
+                    uint32_t v = nu[k];
+                    // N+(v) only holds ids > v, so only the tail of N+(u) after v can match
+                    const size_t t = oriented ? 0 : k+1;
+                    local += intersect(nu+t, du-t, adj.data()+off[v], (size_t)(off[v+1]-off[v]));
+                }
+            }
+            total.fetch_add(local, memory_order_relaxed);
+        });
+        printf("triangles=%llu\n", (unsigned long long)total.load());
+    }
+};
+
+// ========================= Analytics: connected components =========================
+// Lock-free union-find over new ids: roots are always the smallest id of their tree (larger
+// roots are CAS-linked under smaller ones), finds use path halving. Section B is decoded once
+// by the calling thread and handed to union workers in (i, j) batches; nothing is materialized.
 
-    if (argc<6){
-        fprintf(stderr, "Usage: %s -s|-d -i <input> -o <output>\n", argv[0]);
+static inline uint32_t uf_find(atomic<uint32_t>* parent, uint32_t x){
+    for(;;){
+        uint32_t px = parent[x].load(memory_order_relaxed);
+        if (px == x) return x;
+        uint32_t gx = parent[px].load(memory_order_relaxed);
+        if (gx != px) parent[x].compare_exchange_weak(px, gx, memory_order_relaxed);
+        x = gx;
+    }
+}
+
+static inline void uf_union(atomic<uint32_t>* parent, uint32_t a, uint32_t b){
+    for(;;){
+        a = uf_find(parent, a); b = uf_find(parent, b);
+        if (a == b) return;
+        if (a < b) swap(a, b);
+        uint32_t expected = a;
+        if (parent[a].compare_exchange_strong(expected, b, memory_order_relaxed)) return;
+    }
+}
+
+struct ComponentFinder {
+    string in_path, out_path; // out_path is optional: "original_id \t label" per vertex
+    static constexpr size_t kBatchEdges = 1<<15;
+
+    void run(){
+        unique_ptr<GraphFile> gp = open_graph(in_path); // base + delta segments
+        GraphFile &g = *gp;
+        const uint32_t N = g.N;
+        unique_ptr<atomic<uint32_t>[]> parent(new atomic<uint32_t>[N ? N : 1]);
+        parallel_for(N, 1<<16, [&](uint64_t b, uint64_t e){ for (uint64_t x=b;x<e;++x) parent[x].store((uint32_t)x, memory_order_relaxed); });
+
+        const unsigned T = thread_count();
+        if (T <= 1){
+            for_each_graph_row(g, [&](uint32_t i, const uint32_t* nei, const auto*, uint64_t deg){
+                for (uint64_t k=0;k<deg;++k) uf_union(parent.get(), i, nei[k]);
+            });
+        } else {
+            mutex mu; condition_variable cv_ready, cv_space;
+            deque<vector<uint32_t>> ready; vector<vector<uint32_t>> spare;
+            bool done = false;
+            auto worker = [&]{
+                unique_lock<mutex> lk(mu);
+                for(;;){
+                    cv_ready.wait(lk, [&]{ return !ready.empty() || done; });
+                    if (ready.empty()) break;
+                    vector<uint32_t> batch = std::move(ready.front()); ready.pop_front();
+                    cv_space.notify_one();
+                    lk.unlock();
+                    for (size_t k=0;k+1<batch.size();k+=2) uf_union(parent.get(), batch[k], batch[k+1]);
+                    batch.clear();
+                    lk.lock();
+                    spare.push_back(std::move(batch));
+                }
+            };
+            vector<thread> pool;
+            for (unsigned t=0;t<T;++t) pool.emplace_back(worker);
+            vector<uint32_t> batch; batch.reserve(2*kBatchEdges);
+            auto publish = [&]{
+                unique_lock<mutex> lk(mu);
+                cv_space.wait(lk, [&]{ return ready.size() < 2*(size_t)T; });
+                ready.push_back(std::move(batch));
+                if (!spare.empty()){ batch = std::move(spare.back()); spare.pop_back(); }
+                else { batch = vector<uint32_t>(); batch.reserve(2*kBatchEdges); }
+                cv_ready.notify_one();
+            };
+            for_each_graph_row(g, [&](uint32_t i, const uint32_t* nei, const auto*, uint64_t deg){
+                for (uint64_t k=0;k<deg;++k){
+                    if (k && nei[k]==nei[k-1]) continue; // multi-edge
+                    batch.push_back(i); batch.push_back(nei[k]);
+                    if (batch.size() >= 2*kBatchEdges) publish();
+                }
+            });
+            if (!batch.empty()) publish();
+            { lock_guard<mutex> lk(mu); done = true; }
+            cv_ready.notify_all();
+            for (auto &th : pool) th.join();
+        }
+
+        // Flatten: every vertex points at its root, the smallest new id of its component
+        vector<uint32_t> label(N);
+        parallel_for(N, 1<<14, [&](uint64_t b, uint64_t e){ for (uint64_t x=b;x<e;++x) label[x] = uf_find(parent.get(), (uint32_t)x); });
+
+        vector<uint32_t> size_of(N, 0);
+        for (uint32_t x=0;x<N;++x) ++size_of[label[x]];
+        map<uint32_t, uint64_t> hist; // component size -> number of components
+        uint64_t C = 0;
+        for (uint32_t x=0;x<N;++x) if (label[x]==x){ ++hist[size_of[x]]; ++C; }
+        printf("components=%llu\n", (unsigned long long)C);
+        printf("size\tcount\n");
+        for (auto &hc : hist) printf("%u\t%llu\n", hc.first, (unsigned long long)hc.second);
+
+        if (!out_path.empty()){
+            // label = smallest original id in the component (new ids preserve original order)
+            TextWriter tw(out_path);
+            for (uint32_t x=0;x<N;++x){
+                tw.putu(g.orig(x)); tw.put('\t');
+                tw.putu(g.orig(label[x])); tw.newline();
+            }
+            tw.flush();
+        }
+    }
+};
+
+// ========================= CPU dispatch =========================
+// Dispatch levels, each implying the ones before it; avx512 means AVX-512 F, BW and VL. A kernel
+// without a variant at some level uses its best lower one; --kernels reports the result and
+// --kernels=LEVEL caps it (e.g. to compare).
+enum class IsaLevel { Scalar, SSE2, SSE42, AVX2, AVX512 };
+static const char* const kIsaNames[] = {"scalar", "sse2", "sse4.2", "avx2", "avx512"};
+
+static IsaLevel cpu_isa_level(){
+#if GRAPH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) return IsaLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return IsaLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return IsaLevel::SSE42;
+#endif
+#if defined(__SSE2__)
+    return IsaLevel::SSE2;
+#else
+    return IsaLevel::Scalar;
+#endif
+}
+
+static void select_kernels(IsaLevel lv){
+    Kernels k;
+    k.level = kIsaNames[int(lv)];
+    k.prefix_sum = prefix_sum_scalar; k.encode_gaps = encode_gaps_scalar; k.intersect = intersect_scalar;
+    k.decode_gaps = decode_gaps_scalar; k.format_u32 = format_u32_scalar; k.format_u64 = format_u64_scalar;
+#if defined(__SSE2__)
+    if (lv >= IsaLevel::SSE2){
+        k.scan_line = scan_line_sse2; k.prefix_sum = prefix_sum_sse2; k.encode_gaps = encode_gaps_sse2; k.intersect = intersect_sse2;
+        k.format_u32 = format_u32_sse2; k.format_u64 = format_u64_sse2;
+        k.scan_isa = k.prefix_isa = k.encode_isa = k.intersect_isa = k.format_isa = "sse2";
+    }
+#endif
+#if GRAPH_X86
+    if (lv >= IsaLevel::SSE42){ k.scan_line = scan_line_sse42; k.decode_gaps = decode_gaps_sse42; k.scan_isa = k.decode_isa = "sse4.2"; }
+    if (lv >= IsaLevel::AVX2){
+        k.scan_line = scan_line_avx2; k.prefix_sum = prefix_sum_avx2; k.encode_gaps = encode_gaps_avx2; k.intersect = intersect_avx2;
+        k.decode_gaps = decode_gaps_avx2;
+        k.scan_isa = k.prefix_isa = k.encode_isa = k.intersect_isa = k.decode_isa = "avx2";
+    }
+    // Integer formatting stays on SSE2: a number never needs more than one 128-bit vector, and the
+    // same code built for AVX2 (VEX, BMI2) formatted 10- and 20-digit ids no faster.
+    if (lv >= IsaLevel::AVX512){
+        // intersections stay on AVX2: 16x16 blocks overshoot typical row lengths and measured slower
+        k.scan_line = scan_line_avx512; k.prefix_sum = prefix_sum_avx512; k.decode_gaps = decode_gaps_avx512;
+        k.scan_isa = k.prefix_isa = k.decode_isa = "avx512";
+    }
+#endif
+    g_kernels = k;
+}
+
+static void print_kernels(IsaLevel cpu){
+    printf("cpu: %s\n", kIsaNames[int(cpu)]);
+    printf("dispatch: %s\n", g_kernels.level);
+    printf("tokenizer\t%s\n", g_kernels.scan_isa);
+    printf("varint_decode\t%s\n", g_kernels.decode_isa);
+    printf("gap_prefix_sum\t%s\n", g_kernels.prefix_isa);
+    printf("gap_encode\t%s\n", g_kernels.encode_isa);
+    printf("intersect\t%s\n", g_kernels.intersect_isa);
+    printf("int_format\t%s\n", g_kernels.format_isa);
+}
+
+// ========================= CLI =========================
+static int run_batch(const string &manifest, IsaLevel cpu);
+static int run_serve(const string &path, IsaLevel cpu);
+
+// One invocation: parses argv and runs the chosen mode. --batch and --serve jobs come through here too.
+static int run_cli(int argc, char** argv, IsaLevel cpu){
+    if (argc<2){
+        fprintf(stderr, "Usage: %s -s|-d -i <input> -o <output>\n"
+                        "       %s -s -i <input.tsv> -o <graph.bin> [--dedup=first|max|min|sum-saturate] [--orient] [--lean] [--numa [-t threads]] [--mem-stats]\n"
+                        "       %s -s -i <input.tsv> -o <outdir/> --partitions P\n"
+                        "       %s -d -i <graph.bin> -o <output.tsv> [--min-weight T] [--max-weight T] [--vertices ids.txt]\n"
+                        "          [--range a:b | --orig-range a:b] [--shards P [--shard-by range|hash]]\n"
+                        "       %s --triangles -i <graph.bin> [-t threads]\n"
+                        "       %s --components -i <graph.bin> [-o labels.tsv] [-t threads]\n"
+                        "       %s --merge a.bin b.bin ... -o <out.bin> [--dedup]\n"
+                        "       %s --append -i <batch.tsv> -o <base.bin> | --compact -i <base.bin>\n"
+                        "       %s --diff old.bin new.bin -o patch.bin | --patch old.bin patch.bin -o new.bin\n"
+                        "       %s --batch manifest.txt [-t threads]\n"
+                        "       %s --serve /path/sock [-t threads]\n"
+                        "       %s --kernels   (any mode also takes --kernels=scalar|sse2|sse4.2|avx2|avx512)\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
-    bool mode_s=false, mode_d=false; string in_path, out_path;
+    enum class Mode { None, Serialize, Deserialize, Triangles, Components, Merge, Append, Compact, Diff, Patch, Batch, Serve };
+    Mode mode = Mode::None; string in_path, out_path;
+    vector<string> merge_inputs; bool merge_dedup = false;
+    Serializer ser; Deserializer des;
+    bool report_kernels = false, threads_given = false;
+    auto set_mode = [&](Mode m){ if (mode!=Mode::None && mode!=m) die("choose exactly one mode: -s, -d, --triangles, --components, --merge, --append, --compact, --diff, --patch, --batch or --serve"); mode = m; };
     for (int i=1;i<argc;i++){
         string a = argv[i];
-        if (a=="-s") mode_s=true; else if (a=="-d") mode_d=true;
+        if (a=="-s") set_mode(Mode::Serialize); else if (a=="-d") set_mode(Mode::Deserialize);
+        else if (a=="--triangles") set_mode(Mode::Triangles);
+        else if (a=="--components") set_mode(Mode::Components);
+        else if (a=="--merge"){ set_mode(Mode::Merge); while (i+1<argc && argv[i+1][0]!='-') merge_inputs.push_back(argv[++i]); }
+        else if (a=="--dedup") merge_dedup = true;
+        else if (a=="--orient") ser.orient = true;
+        else if (a=="--mem-stats") ser.mem_stats = true;
+        else if (a=="--lean") ser.lean = true;
+        else if (a=="--numa") ser.numa = true;
+        else if (a.rfind("--dedup=", 0)==0){
+            string v = a.substr(8);
+            if (v=="first") ser.dedup = Dedup::First; else if (v=="max") ser.dedup = Dedup::Max;
+            else if (v=="min") ser.dedup = Dedup::Min; else if (v=="sum-saturate") ser.dedup = Dedup::SumSaturate;
+            else die("--dedup must be first, max, min or sum-saturate");
+        }
+        else if ((a=="--diff" || a=="--patch") && i+2<argc){ set_mode(a=="--diff" ? Mode::Diff : Mode::Patch); merge_inputs = {argv[i+1], argv[i+2]}; i += 2; }
+        else if (a=="--append") set_mode(Mode::Append);
+        else if (a=="--compact") set_mode(Mode::Compact);
+        else if (a=="--batch" && i+1<argc){ set_mode(Mode::Batch); in_path = argv[++i]; }
+        else if (a=="--serve" && i+1<argc){ set_mode(Mode::Serve); in_path = argv[++i]; }
+        else if (a=="--kernels") report_kernels = true;
+        else if (a.rfind("--kernels=", 0)==0){
+            const string v = a.substr(10);
+            int lv = 0;
+            while (lv <= int(IsaLevel::AVX512) && v != kIsaNames[lv]) ++lv;
+            if (lv > int(IsaLevel::AVX512)) die("--kernels must be scalar, sse2, sse4.2, avx2 or avx512");
+            if (lv > int(cpu)) die("--kernels=" + v + " is not supported by this CPU (max " + kIsaNames[int(cpu)] + ")");
+            select_kernels(IsaLevel(lv));
+        }
         else if (a=="-i" && i+1<argc) { in_path = argv[++i]; }
         else if (a=="-o" && i+1<argc) { out_path = argv[++i]; }
+        else if (a=="-t" && i+1<argc) { g_threads = (unsigned)parse_num_arg(argv[++i], "-t"); threads_given = true; }
+        else if (a=="--min-weight" && i+1<argc) { des.filter.wmin = (unsigned)parse_num_arg(argv[++i], "--min-weight"); }
+        else if (a=="--max-weight" && i+1<argc) { des.filter.wmax = (unsigned)parse_num_arg(argv[++i], "--max-weight"); }
+        else if (a=="--vertices" && i+1<argc) { des.filter.vertices_path = argv[++i]; }
+        else if (a=="--range" && i+1<argc) { des.filter.range_spec = argv[++i]; des.filter.range_orig = false; }
+        else if (a=="--orig-range" && i+1<argc) { des.filter.range_spec = argv[++i]; des.filter.range_orig = true; }
+        else if (a=="--partitions" && i+1<argc) { ser.partitions = (unsigned)parse_num_arg(argv[++i], "--partitions"); if (!ser.partitions) die("--partitions must be positive"); }
+        else if (a=="--shards" && i+1<argc) { des.shards = (unsigned)parse_num_arg(argv[++i], "--shards"); if (!des.shards) die("--shards must be positive"); }
+        else if (a=="--shard-by" && i+1<argc) {
+            string v = argv[++i];
+            if (v=="hash") des.shard_by_hash = true; else if (v=="range") des.shard_by_hash = false; else die("--shard-by must be range or hash");
+        }
+        else if (t_die_throws) die("unknown/invalid arg: " + a); // --batch or --serve job
         else { fprintf(stderr, "Unknown/invalid arg: %s\n", a.c_str()); return 1; }
     }
-    if (mode_s == mode_d) die("choose exactly one mode: -s or -d");
-    if (in_path.empty() || out_path.empty()) die("-i and -o are required");
+    if (report_kernels){
+        if (mode != Mode::None) die("--kernels cannot be combined with a mode");
+        print_kernels(cpu);
+        return 0;
+    }
+    if (mode == Mode::None) die("choose exactly one mode: -s, -d, --triangles, --components, --merge, --append, --compact, --diff, --patch, --batch or --serve");
+    if (mode == Mode::Batch){
+        if (argc != (threads_given ? 5 : 3)) die("--batch takes only a manifest and -t");
+        if (!file_exists(in_path)) die("manifest not found: " + in_path);
+        return run_batch(in_path, cpu);
+    }
+    if (mode == Mode::Serve){
+        if (argc != (threads_given ? 5 : 3)) die("--serve takes only a socket path and -t");
+        return run_serve(in_path, cpu);
+    }
+    if (mode == Mode::Merge){
+        if (merge_inputs.empty() || out_path.empty()) die("--merge needs input files and -o");
+        for (auto &p : merge_inputs) if (!file_exists(p)) die("input BIN not found: "+p);
+        GraphMerge(merge_inputs, merge_dedup).write(out_path);
+        return 0;
+    }
+    if (mode == Mode::Diff || mode == Mode::Patch){
+        if (out_path.empty()) die("-o is required");
+        for (auto &p : merge_inputs) if (!file_exists(p)) die("input not found: "+p);
+        if (mode == Mode::Diff) diff_graphs(merge_inputs[0], merge_inputs[1], out_path);
+        else PatchedGraph(merge_inputs[0], merge_inputs[1]).write(out_path);
+        return 0;
+    }
+    if (merge_dedup) die("--dedup requires --merge");
+    if (in_path.empty()) die("-i is required");
+    if (mode == Mode::Append){
+        // -i batch.tsv -o base.bin: the batch becomes the next delta segment of base.bin
+        if (out_path.empty()) die("--append needs -o <base.bin>");
+        if (!file_exists(in_path)) die("input TSV not found: "+in_path);
+        if (!file_exists(out_path)) die("base BIN not found: "+out_path);
+        if (ser.partitions) die("--partitions cannot be combined with --append");
+        {
+            GraphFile base(out_path);
+            if (ser.orient || (base.flags & kFlagOriented)) die("--append cannot be used with --orient graphs");
+            if (base.wide()) die("--append cannot be used with graphs that have 64-bit ids or 16-bit weights");
+        }
+        ser.narrow = true;
+        ser.in_path = in_path; ser.out_path = delta_path(out_path, (unsigned)delta_segments(out_path).size()+1); ser.run();
+        return 0;
+    }
+    if (mode == Mode::Compact){
+        if (!file_exists(in_path)) die("input BIN not found: "+in_path);
+        compact_graph(in_path);
+        return 0;
+    }
+    if ((mode == Mode::Serialize || mode == Mode::Deserialize) && out_path.empty()) die("-i and -o are required");
+    if (mode != Mode::Deserialize && des.filter.active()) die("--min-weight/--max-weight/--vertices/--range/--orig-range require -d");
+    if (des.filter.wmin > 0xFFFF || des.filter.wmax > 0xFFFF) die("weight bounds must be in 0..65535");
+    if (mode != Mode::Deserialize && des.shards) die("--shards requires -d");
+    if (mode != Mode::Serialize && ser.partitions) die("--partitions requires -s");
+    if (mode != Mode::Serialize && mode != Mode::Append && ser.dedup != Dedup::None) die("--dedup=<mode> requires -s or --append");
+    if (mode != Mode::Serialize && ser.orient) die("--orient requires -s");
+    if (mode != Mode::Serialize && mode != Mode::Append && (ser.mem_stats || ser.lean || ser.numa)) die("--mem-stats, --lean and --numa require -s or --append");
+    if (des.filter.by_vertex() && !file_exists(des.filter.vertices_path)) die("vertex file not found: "+des.filter.vertices_path);
 
-    if (mode_s){
+    if (mode == Mode::Serialize){
         if (!file_exists(in_path)) die("input TSV not found: "+in_path);
-        Serializer s; s.in_path=in_path; s.out_path=out_path; s.run();
+        ser.in_path=in_path; ser.out_path=out_path; ser.run();
     } else {
         if (!file_exists(in_path)) die("input BIN not found: "+in_path);
-        Deserializer d; d.in_path=in_path; d.out_path=out_path; d.run();
+        if (mode == Mode::Deserialize){ des.in_path=in_path; des.out_path=out_path; des.run(); }
+        else if (mode == Mode::Triangles){ TriangleCounter t; t.in_path=in_path; t.run(); }
+        else { ComponentFinder c; c.in_path=in_path; c.out_path=out_path; c.run(); }
     }
     return 0;
 }
+
+// A --batch or --serve job "MODE INPUT OUTPUT [OPTIONS...]" as run_cli arguments. MODE is s, d or
+// append; the process-wide flags are refused. Returns "" or why the job is invalid.
+static string job_args(const vector<string> &tok, vector<string> &args){
+    if (tok.size() < 3) return "expected MODE INPUT OUTPUT [OPTIONS...]";
+    const string mode = tok[0] == "s" ? "-s" : tok[0] == "d" ? "-d" : tok[0] == "append" ? "--append" : "";
+    if (mode.empty()) return "mode must be s, d or append";
+    args = {"run", mode, "-i", tok[1], "-o", tok[2]};
+    for (size_t k=3;k<tok.size();++k){
+        const string &o = tok[k];
+        if (o=="-t" || o=="--numa" || o=="--mem-stats" || o=="--batch" || o=="--serve" || o.rfind("--kernels", 0)==0 || o=="-i" || o=="-o")
+            return o + " cannot be used in a job";
+        args.push_back(o);
+    }
+    return "";
+}
+
+// Runs a job on the calling thread, which must have t_die_throws set. msg gets OUTPUT or the error;
+// any exception fails only the job.
+static bool run_job(vector<string> &args, IsaLevel cpu, string &msg){
+    vector<char*> argv;
+    for (string &a : args) argv.push_back(a.data());
+    try {
+        const bool ok = run_cli(int(argv.size()), argv.data(), cpu) == 0;
+        msg = args[5];
+        return ok;
+    } catch (const std::exception &e){ msg = e.what(); } // JobError from die(), or e.g. bad_alloc
+    return false;
+}
+
+// --batch: each manifest line "MODE INPUT OUTPUT [OPTIONS...]" (whitespace-separated, '#' starts a
+// comment line) is one job. MODE is s, d or append, and OPTIONS are the flags that mode takes on the
+// command line, except the process-wide -t, --numa, --mem-stats and --kernels=. Jobs are pulled
+// by -t worker threads from a shared counter and run single-threaded in-process, each worker
+// reusing its write buffers, small-input read buffer and serializer arena from job to job. A
+// failing job (its die()) fails only itself. One result line per job goes to stdout in manifest
+// order, "LINE\tok|failed\tMILLISECONDS\tOUTPUT|ERROR", with totals on stderr; the exit status is 1
+// if any job failed. Jobs run concurrently and in no fixed order, so no job may read or write a
+// file another job writes.
+static int run_batch(const string &manifest, IsaLevel cpu){
+    struct Job { unsigned line; vector<string> args; bool ok = false; double ms = 0; string msg; };
+    vector<Job> jobs;
+    {
+        std::ifstream in(manifest);
+        string text;
+        for (unsigned line=1; std::getline(in, text); ++line){
+            std::istringstream ss(text);
+            vector<string> tok;
+            for (string w; ss >> w;) tok.push_back(w);
+            if (tok.empty() || tok[0][0]=='#') continue;
+            Job j; j.line = line;
+            const string err = job_args(tok, j.args);
+            if (!err.empty()) die("manifest line " + to_string(line) + ": " + err);
+            jobs.push_back(std::move(j));
+        }
+    }
+    const unsigned T = thread_count();
+    g_threads = 1; // jobs run single-threaded; the pool is the parallelism
+    atomic<size_t> next{0};
+    const auto t0 = std::chrono::steady_clock::now();
+    auto work = [&]{
+        t_die_throws = true;
+        for (size_t k; (k = next.fetch_add(1)) < jobs.size();){
+            Job &j = jobs[k];
+            const auto s0 = std::chrono::steady_clock::now();
+            j.ok = run_job(j.args, cpu, j.msg);
+            j.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - s0).count();
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t=1;t<T;++t) pool.emplace_back(work);
+    work();
+    for (auto &th : pool) th.join();
+    t_die_throws = false;
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    size_t failed = 0;
+    for (const Job &j : jobs){
+        printf("%u\t%s\t%.3f\t%s\n", j.line, j.ok ? "ok" : "failed", j.ms, j.msg.c_str());
+        failed += !j.ok;
+    }
+    fprintf(stderr, "batch: %zu jobs, %zu ok, %zu failed, %u threads, %.2f s, %.0f jobs/s\n",
+            jobs.size(), jobs.size() - failed, failed, T, secs, secs > 0 ? jobs.size() / secs : 0.0);
+    return failed ? 1 : 0;
+}
+
+// ========================= Service (--serve) =========================
+// --serve PATH keeps the process resident behind a Unix stream socket at PATH, so callers issuing
+// many small requests skip process startup and cold caches. Every message, both ways, is a frame
+// [uint32 LE length][payload]. A request payload is one whitespace-separated command:
+//   s|d|append INPUT OUTPUT [OPTIONS...]   a job, as in a --batch manifest
+//   load PATH | unload PATH               map PATH (with its delta segments) and keep it resident
+//   neighbors PATH ID                      "ID\tWEIGHT" lines for original id ID (loads PATH)
+//   query PATH, then one lookup per line   "n ID" or "e U V" in original ids, answered as a QueryBatch
+//   stats [reset] | ping | shutdown
+// and the response payload is "ok\n" plus the result or "error\n" plus the message. Each of the -t
+// workers serves one connection at a time, any number of requests on it, with its writer and read
+// buffers faulted in and its arena reserved before the first request, all reused after. Query
+// batches fan out to -t reader threads. Resident graphs are shared read-only by all of them; a job
+// may not overwrite one, and an append drops it (its next query reloads base + deltas).
+// The bound socket path, removed on every way out of --serve: a normal stop, die()/exit, a fatal
+// signal (SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGABRT) or std::terminate.
+static char g_serve_socket[sizeof(sockaddr_un::sun_path)];
+static void unlink_serve_socket(){ if (g_serve_socket[0]){ ::unlink(g_serve_socket); g_serve_socket[0] = 0; } }
+static void serve_fatal_signal(int sig){ unlink_serve_socket(); ::signal(sig, SIG_DFL); ::raise(sig); }
+static void own_serve_socket(const string &path){
+    memcpy(g_serve_socket, path.c_str(), path.size() + 1);
+    std::atexit(unlink_serve_socket);
+    for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGABRT}) ::signal(sig, serve_fatal_signal);
+    static std::terminate_handler prev = std::set_terminate([]{ unlink_serve_socket(); (prev ? prev : std::abort)(); });
+}
+
+static bool read_full(int fd, void* p, size_t n){
+    for (char* c = (char*)p; n;){
+        const ssize_t r = ::read(fd, c, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        c += r; n -= size_t(r);
+    }
+    return true;
+}
+static bool send_full(int fd, const void* p, size_t n){
+    for (const char* c = (const char*)p; n;){
+        const ssize_t r = ::send(fd, c, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        c += r; n -= size_t(r);
+    }
+    return true;
+}
+
+// Lock-free log-linear histogram of microsecond latencies: 8 buckets per power of two, so a
+// quantile, reported as the upper edge of its bucket, is at most 1/8 above the true value.
+struct LatencyHistogram {
+    static constexpr unsigned kBuckets = 8 * 64;
+    atomic<uint64_t> n[kBuckets] = {};
+    static unsigned bucket(uint64_t us){
+        if (us < 8) return unsigned(us);
+        const unsigned e = 63 - __builtin_clzll(us);
+        return (e-2)*8 + unsigned((us >> (e-3)) & 7);
+    }
+    static uint64_t upper(unsigned b){ return b < 8 ? b : ((uint64_t(8 + b%8 + 1) << (b/8 - 1)) - 1); }
+    void add(uint64_t us){ n[bucket(us)].fetch_add(1, std::memory_order_relaxed); }
+    void clear(){ for (auto &c : n) c.store(0, std::memory_order_relaxed); }
+    uint64_t count() const { uint64_t t = 0; for (auto &c : n) t += c.load(std::memory_order_relaxed); return t; }
+    uint64_t quantile(double q) const {
+        const uint64_t total = count();
+        if (!total) return 0;
+        const uint64_t want = max<uint64_t>(1, uint64_t(std::ceil(q * total)));
+        uint64_t seen = 0;
+        for (unsigned b=0;b<kBuckets;++b) if ((seen += n[b].load(std::memory_order_relaxed)) >= want) return upper(b);
+        return upper(kBuckets-1);
+    }
+};
+
+struct Service {
+    static constexpr uint32_t kMaxRequest = 16u << 20;
+    IsaLevel cpu;
+    string path;
+    int lfd = -1;
+    std::shared_mutex gm;
+    map<string, shared_ptr<const GraphFile>> graphs; // by realpath
+    std::mutex qm;
+    std::condition_variable qcv;
+    deque<int> ready;
+    std::set<int> open; // accepted connections, shut down on stop
+    bool stopping = false;
+    atomic<uint64_t> requests{0}, errors{0};
+    unique_ptr<ThreadPool> readers;
+    // `stats` window, restarted by `stats reset`
+    struct Stats {
+        atomic<uint64_t> requests{0}, failed{0}, lookups{0};
+        LatencyHistogram queries, jobs; // query/neighbors requests; s/d/append jobs
+        std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+    } st;
+    std::mutex stm; // serializes `stats`; a request racing a reset may land in either window
+
+    Service(const string &p, IsaLevel c) : cpu(c), path(p) {}
+
+    static string key(const string &p){
+        char buf[PATH_MAX];
+        return ::realpath(p.c_str(), buf) ? string(buf) : p;
+    }
+    shared_ptr<const GraphFile> graph(const string &p){
+        const string k = key(p);
+        {
+            std::shared_lock<std::shared_mutex> lk(gm);
+            auto it = graphs.find(k);
+            if (it != graphs.end()) return it->second;
+        }
+        if (!file_exists(p)) die("input BIN not found: " + p);
+        unique_ptr<GraphFile> g = open_graph(p);
+        if (!g->loops) g->scan_index();
+        std::unique_lock<std::shared_mutex> lk(gm);
+        return graphs.emplace(k, shared_ptr<const GraphFile>(std::move(g))).first->second; // a racing load wins
+    }
+    bool resident(const string &p){ std::shared_lock<std::shared_mutex> lk(gm); return graphs.count(key(p)); }
+    void drop(const string &p){ std::unique_lock<std::shared_mutex> lk(gm); graphs.erase(key(p)); }
+
+    // Executes one request; returns false with the error in out.
+    bool handle(const string &req, string &out){
+        std::istringstream ss(req);
+        vector<string> tok;
+        for (string w; ss >> w;) tok.push_back(w);
+        if (tok.empty()){ out = "empty request"; return false; }
+        const string &cmd = tok[0];
+        if (cmd == "ping" && tok.size() == 1) return true;
+        if (cmd == "shutdown" && tok.size() == 1){ stop(); return true; }
+        if ((cmd == "load" || cmd == "unload") && tok.size() == 2){
+            if (cmd == "unload"){ drop(tok[1]); return true; }
+            auto g = graph(tok[1]);
+            out = "vertices=" + to_string(g->N) + " edges=" + to_string(g->M_total) + "\n";
+            return true;
+        }
+        if (cmd == "neighbors" && tok.size() == 3){
+            auto g = graph(tok[1]);
+            QueryBatch qb;
+            qb.q.push_back({vertex(*g, tok[2]), 0, false});
+            if (qb.q[0].u == g->N) die("vertex not in graph: " + tok[2]);
+            qb.run(*g, *readers);
+            for (size_t h=0;h<qb.hits.size();++h){ out += to_string(g->orig(qb.hits[h].first)); out += '\t'; out += to_string(qb.hits[h].second); out += '\n'; }
+            st.lookups += 1;
+            return true;
+        }
+        if (cmd == "query") return query(req, out);
+        if (cmd == "stats" && (tok.size() == 1 || (tok.size() == 2 && tok[1] == "reset"))){ stats(out, tok.size() == 2); return true; }
+        if (cmd == "s" || cmd == "d" || cmd == "append"){
+            vector<string> args;
+            out = job_args(tok, args);
+            if (!out.empty()) return false;
+            if (cmd != "append" && resident(args[5])) die("output is a loaded graph, unload it first: " + args[5]);
+            const bool ok = run_job(args, cpu, out);
+            if (cmd == "append") drop(args[5]);
+            return ok;
+        }
+        out = "unknown request: " + cmd;
+        return false;
+    }
+
+    // New id of original id text x, N if the graph does not have it.
+    static uint32_t vertex(const GraphFile &g, const string &x){
+        const uint64_t id = parse_num_arg(x, "vertex id");
+        const uint32_t v = g.lower_orig(id);
+        return v < g.N && g.orig(v) == id ? v : g.N;
+    }
+
+    // "query PATH\n" then lines "n ID" or "e U V". One answer line per lookup, in order: for n the
+    // neighbors as "ID:WEIGHT" separated by spaces ("-" if ID is not in the graph), for e "0" if there
+    // is no such edge, else "1\t" and the weights of its copies separated by spaces.
+    bool query(const string &req, string &out){
+        std::istringstream in(req);
+        string line;
+        std::getline(in, line);
+        vector<string> tok;
+        { std::istringstream ss(line); for (string w; ss >> w;) tok.push_back(w); }
+        if (tok.size() != 2) die("expected \"query PATH\" on the first line");
+        auto g = graph(tok[1]);
+        QueryBatch qb;
+        for (unsigned ln=2; std::getline(in, line); ++ln){
+            std::istringstream ss(line);
+            tok.clear();
+            for (string w; ss >> w;) tok.push_back(w);
+            if (tok.empty()) continue;
+            if (tok[0] == "n" && tok.size() == 2) qb.q.push_back({vertex(*g, tok[1]), 0, false});
+            else if (tok[0] == "e" && tok.size() == 3) qb.q.push_back({vertex(*g, tok[1]), vertex(*g, tok[2]), true});
+            else die("query line " + to_string(ln) + ": expected \"n ID\" or \"e U V\"");
+        }
+        qb.run(*g, *readers);
+        for (size_t k=0;k<qb.q.size();++k){
+            const QueryBatch::Query &x = qb.q[k];
+            if (x.edge){
+                if (qb.at[k] == qb.at[k+1]){ out += "0\n"; continue; }
+                out += "1\t";
+            } else if (x.u == g->N){ out += "-\n"; continue; }
+            for (size_t h=qb.at[k];h<qb.at[k+1];++h){
+                if (h > qb.at[k]) out += ' ';
+                if (!x.edge){ out += to_string(g->orig(qb.hits[h].first)); out += ':'; }
+                out += to_string(qb.hits[h].second);
+            }
+            out += '\n';
+        }
+        st.lookups += qb.q.size();
+        return true;
+    }
+
+    // "NAME\tVALUE" lines over the window since start or the last `stats reset`: request and
+    // lookup counts, lookups per second, and p50/p99/max latency in microseconds of query requests
+    // (query, neighbors) and of jobs, measured from a request's arrival to its response.
+    void stats(string &out, bool reset){
+        std::lock_guard<std::mutex> lk(stm);
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - st.since).count();
+        char buf[96];
+        auto put = [&](const string &name, uint64_t v){ out += name; out += '\t'; out += to_string(v); out += '\n'; };
+        snprintf(buf, sizeof(buf), "window_s\t%.3f\n", secs); out += buf;
+        put("requests", st.requests.load());
+        put("failed", st.failed.load());
+        put("lookups", st.lookups.load());
+        snprintf(buf, sizeof(buf), "qps\t%.1f\n", secs > 0 ? st.lookups.load() / secs : 0.0); out += buf;
+        for (auto &[name, h] : {pair<string, LatencyHistogram*>{"query", &st.queries}, {"job", &st.jobs}}){
+            put(name + "_requests", h->count());
+            put(name + "_p50_us", h->quantile(0.50));
+            put(name + "_p99_us", h->quantile(0.99));
+            put(name + "_max_us", h->quantile(1.0));
+        }
+        if (reset){
+            st.requests = 0; st.failed = 0; st.lookups = 0;
+            st.queries.clear(); st.jobs.clear();
+            st.since = std::chrono::steady_clock::now();
+        }
+    }
+
+    void stop(){
+        std::lock_guard<std::mutex> lk(qm);
+        if (stopping) return;
+        stopping = true;
+        ::shutdown(lfd, SHUT_RDWR); // wakes accept()
+        for (int fd : open) ::shutdown(fd, SHUT_RD); // idle connections see EOF
+        qcv.notify_all();
+    }
+
+    void serve_connection(int fd){
+        string req, resp;
+        for (uint32_t len; read_full(fd, &len, 4);){ // little-endian host
+            if (len > kMaxRequest) break;
+            req.resize(len);
+            if (!read_full(fd, req.data(), len)) break;
+            const auto t0 = std::chrono::steady_clock::now();
+            string out;
+            bool ok = false;
+            try { ok = handle(req, out); }
+            catch (const JobError &e){ out = e.what(); }
+            catch (const std::exception &e){ out = e.what(); }
+            ++requests; errors += !ok;
+            {
+                const string cmd = req.substr(0, req.find_first_of(" \t\n"));
+                LatencyHistogram* h = cmd == "query" || cmd == "neighbors" ? &st.queries
+                                    : cmd == "s" || cmd == "d" || cmd == "append" ? &st.jobs : nullptr;
+                ++st.requests; st.failed += !ok;
+                if (h) h->add(uint64_t(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count()));
+            }
+            resp.assign(4, '\0');
+            resp += ok ? "ok\n" : "error\n";
+            resp += out;
+            const uint32_t n = uint32_t(resp.size() - 4);
+            memcpy(resp.data(), &n, 4);
+            if (!send_full(fd, resp.data(), resp.size())) break;
+        }
+        std::lock_guard<std::mutex> lk(qm);
+        open.erase(fd);
+        ::close(fd);
+    }
+
+    void worker(){
+        t_die_throws = true;
+        try { // warming is only a head start: a failure here surfaces again, per request, in the job
+            { vector<unsigned char> b; take_spare(b, 1<<20); b.resize(1<<20); give_spare(b); } // BinWriter
+            { vector<char> b; take_spare(b, TextWriter::kFlush + TextWriter::kSlack); b.resize(b.capacity()); give_spare(b); } // TextWriter, MMap
+            { Arena a(Arena::kKeep); }
+        } catch (const std::exception &){}
+        for (;;){
+            int fd;
+            {
+                std::unique_lock<std::mutex> lk(qm);
+                qcv.wait(lk, [&]{ return stopping || !ready.empty(); });
+                if (ready.empty()) return;
+                fd = ready.front(); ready.pop_front();
+                if (stopping) ::shutdown(fd, SHUT_RD);
+            }
+            serve_connection(fd);
+        }
+    }
+
+    int run(){
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) die("socket path too long: " + path);
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        lfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (lfd < 0) die("cannot create socket");
+        struct stat st{};
+        if (::lstat(path.c_str(), &st) == 0){
+            // a socket left behind by a server that is gone is replaced; a live one is not
+            if (!S_ISSOCK(st.st_mode)) die("exists and is not a socket: " + path);
+            int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            const bool live = ::connect(probe, (const sockaddr*)&addr, sizeof(addr)) == 0;
+            ::close(probe);
+            if (live) die("already being served: " + path);
+            ::unlink(path.c_str());
+        }
+        if (::bind(lfd, (const sockaddr*)&addr, sizeof(addr)) != 0) die("cannot bind socket: " + path);
+        own_serve_socket(path);
+        if (::listen(lfd, 128) != 0) die("cannot listen on socket: " + path);
+
+        const unsigned T = thread_count();
+        g_threads = 1; // requests run single-threaded; the workers are the parallelism
+        readers.reset(new ThreadPool(T));
+        vector<thread> pool;
+        for (unsigned t=0;t<T;++t) pool.emplace_back([this]{ worker(); });
+        fprintf(stderr, "serve: listening on %s, %u workers, %u readers\n", path.c_str(), T, T);
+        const auto t0 = std::chrono::steady_clock::now();
+        for (;;){
+            const int fd = ::accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            const int err = errno;
+            std::unique_lock<std::mutex> lk(qm);
+            if (stopping){ if (fd >= 0) ::close(fd); break; }
+            if (fd < 0){
+                lk.unlock();
+                if (err == EMFILE || err == ENFILE) std::this_thread::sleep_for(std::chrono::milliseconds(10)); // until connections close
+                else if (err != EINTR && err != ECONNABORTED) die("accept failed on " + path);
+                continue;
+            }
+            ready.push_back(fd); open.insert(fd);
+            qcv.notify_one();
+        }
+        for (auto &th : pool) th.join();
+        ::close(lfd);
+        unlink_serve_socket();
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        fprintf(stderr, "serve: %llu requests, %llu failed, %.1f s\n",
+                (unsigned long long)requests.load(), (unsigned long long)errors.load(), secs);
+        return 0;
+    }
+};
+static int run_serve(const string &path, IsaLevel cpu){ return Service(path, cpu).run(); }
+
+int main(int argc, char** argv){
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+    const IsaLevel cpu = cpu_isa_level();
+    select_kernels(cpu);
+    return run_cli(argc, argv, cpu);
+}